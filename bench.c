@@ -0,0 +1,231 @@
+// Throughput benchmark for LFSPSCQueue.
+//
+// Sweeps element size, queue buffer length, batch size, and producer/consumer
+// core placement. Every configuration is run multiple times and the results
+// are reported as throughput of the median run and minimum, median, and maximum
+// time per message across runs.
+//
+// Usage: ./bench [-r runs] [-n messages] [-c producer_cpu,consumer_cpu]...
+// Each -c adds a core placement to sweep. Without -c, threads are not pinned,
+// and if there are at least 2 CPUs, CPUs 0 and 1 are also measured.
+
+#include "lfc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const size_t element_sizes[]  = { 8, 64, 512 };
+static const size_t buffer_lengths[] = { 1 << 8, 1 << 12, 1 << 16 };
+static const size_t batch_sizes[]    = { 1, 32, 256 };
+
+#define ARRAY_LENGTH(A) (sizeof(A) / sizeof((A)[0]))
+#define MAX_PLACEMENTS 16
+
+typedef struct placement
+{
+    int producer_cpu; // negative for not pinned
+    int consumer_cpu;
+} Placement;
+
+typedef struct config
+{
+    size_t    element_size;
+    size_t    buffer_length;
+    size_t    batch_size;
+    size_t    messages;
+    Placement placement;
+} Config;
+
+static LFSPSCQueue queue;
+static LFAtomic(bool) started;
+
+static void* allocate(size_t length, size_t element_size)
+{
+    void* memory = calloc(length, element_size);
+    if (memory == NULL) {
+        fprintf(stderr, "Could not allocate %zu bytes.\n", length * element_size);
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static void pin(int cpu)
+{
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        fprintf(stderr, "Could not pin thread to CPU %i.\n", cpu);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void* produce(void* _config)
+{
+    const Config* config = _config;
+    pin(config->placement.producer_cpu);
+    unsigned char* elems = allocate(config->batch_size, config->element_size);
+    while ( ! atomic_load_explicit(&started, memory_order_acquire))
+        ;
+
+    for (uint64_t sent = 0; sent < config->messages;)
+    {
+        size_t count = config->messages - sent < config->batch_size ?
+            config->messages - sent : config->batch_size;
+        for (size_t i = 0; i < count; ++i)
+            memcpy(elems + i * config->element_size, &(uint64_t){sent + i}, sizeof(uint64_t));
+
+        if (config->batch_size == 1)
+            sent += lf_spsc_enqueue(&queue, elems, config->element_size);
+        else
+            sent += lf_spsc_enqueue_n(&queue, elems, config->element_size, count);
+    }
+    free(elems);
+    return NULL;
+}
+
+static void* consume(void* _config)
+{
+    const Config* config = _config;
+    pin(config->placement.consumer_cpu);
+    unsigned char* elems = allocate(config->batch_size, config->element_size);
+    while ( ! atomic_load_explicit(&started, memory_order_acquire))
+        ;
+
+    for (uint64_t received = 0; received < config->messages;)
+    {
+        size_t count;
+        if (config->batch_size == 1)
+            count = lf_spsc_dequeue(&queue, elems, config->element_size) != NULL;
+        else
+            count = lf_spsc_dequeue_n(&queue, elems, config->element_size, config->batch_size);
+
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t sequence;
+            memcpy(&sequence, elems + i * config->element_size, sizeof sequence);
+            if (sequence != received + i) {
+                fprintf(stderr, "Expected message %llu, got %llu.\n",
+                    (unsigned long long)(received + i), (unsigned long long)sequence);
+                exit(EXIT_FAILURE);
+            }
+        }
+        received += count;
+    }
+    free(elems);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double run(Config* config, void* buffer)
+{
+    memset(&queue, 0, sizeof queue);
+    queue.buffer        = buffer;
+    queue.buffer_length = config->buffer_length;
+    atomic_store(&started, false);
+
+    pthread_t producer, consumer;
+    pthread_create(&producer, NULL, produce, config);
+    pthread_create(&consumer, NULL, consume, config);
+    double t0 = now();
+    atomic_store_explicit(&started, true, memory_order_release);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    return now() - t0;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    return (*(const double*)a > *(const double*)b) - (*(const double*)a < *(const double*)b);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t    runs       = 11;
+    size_t    messages   = 1 << 20;
+    Placement placements[MAX_PLACEMENTS];
+    size_t    placements_length = 0;
+
+    for (int opt; (opt = getopt(argc, argv, "r:n:c:")) != -1;) switch (opt)
+    {
+        case 'r':
+            runs = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            messages = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            if (placements_length == MAX_PLACEMENTS ||
+                sscanf(optarg, "%i,%i",
+                    &placements[placements_length].producer_cpu,
+                    &placements[placements_length].consumer_cpu) != 2)
+                goto usage;
+            ++placements_length;
+            break;
+        default:
+            goto usage;
+    }
+    if (runs == 0 || messages == 0)
+        goto usage;
+    if (placements_length == 0) {
+        placements[placements_length++] = (Placement){ -1, -1 };
+        if (sysconf(_SC_NPROCESSORS_ONLN) >= 2)
+            placements[placements_length++] = (Placement){ 0, 1 };
+    }
+
+    double* times  = allocate(runs, sizeof times[0]);
+    void*   buffer = allocate(buffer_lengths[ARRAY_LENGTH(buffer_lengths) - 1], element_sizes[ARRAY_LENGTH(element_sizes) - 1]);
+
+    printf("%i runs of %zu messages\n", (int)runs, messages);
+    printf("%6s %7s %6s %9s | %10s %8s | %10s %10s %10s\n",
+        "elem", "buffer", "batch", "cpus", "Mmsg/s", "GB/s", "min ns", "median ns", "max ns");
+
+    for (size_t p = 0; p < placements_length; ++p)
+    for (size_t e = 0; e < ARRAY_LENGTH(element_sizes); ++e)
+    for (size_t l = 0; l < ARRAY_LENGTH(buffer_lengths); ++l)
+    for (size_t b = 0; b < ARRAY_LENGTH(batch_sizes); ++b)
+    {
+        Config config = {
+            .element_size  = element_sizes[e],
+            .buffer_length = buffer_lengths[l],
+            .batch_size    = batch_sizes[b],
+            .messages      = messages,
+            .placement     = placements[p],
+        };
+        for (size_t i = 0; i < runs; ++i)
+            times[i] = run(&config, buffer);
+        qsort(times, runs, sizeof times[0], compare_doubles);
+
+        const double min    = times[0];
+        const double median = times[runs / 2];
+        const double max    = times[runs - 1];
+        char cpus[32] = "any";
+        if (config.placement.producer_cpu >= 0)
+            snprintf(cpus, sizeof cpus, "%i,%i", config.placement.producer_cpu, config.placement.consumer_cpu);
+
+        printf("%6zu %7zu %6zu %9s | %10.2f %8.2f | %10.2f %10.2f %10.2f\n",
+            config.element_size, config.buffer_length, config.batch_size, cpus,
+            messages / median / 1e6,
+            messages * config.element_size / median / 1e9,
+            min * 1e9 / messages, median * 1e9 / messages, max * 1e9 / messages);
+        fflush(stdout);
+    }
+    free(times);
+    free(buffer);
+    return EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "Usage: %s [-r runs] [-n messages] [-c producer_cpu,consumer_cpu]...\n", argv[0]);
+    return EXIT_FAILURE;
+}
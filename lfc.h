@@ -12,8 +12,34 @@
 #endif
 #include <stdalign.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#if !__cplusplus
+#include <time.h>
+#else
+#include <chrono>
+#endif
+
+// Linux specific features need POSIX and Linux extensions from system headers,
+// e.g. compile with -D_GNU_SOURCE. Otherwise portable fallbacks are used.
+#if defined(__linux__) && defined(_DEFAULT_SOURCE)
+#define LF_LINUX 1
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// POSIX specific features, also hidden by strict ISO C modes.
+#if (defined(__unix__) && (defined(_DEFAULT_SOURCE) || _POSIX_C_SOURCE >= 200112L)) || defined(__APPLE__)
+#define LF_POSIX 1
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 // ----------------------------------------------------------------------------
@@ -24,9 +50,13 @@
 
 
 // ------------------------------------------------------------
-// Wait-free Single Producer Single Consumer type generic queue
+// Type generic queues
 
-/** Generic SPSC queue type.*/
+/** Generic queue type.
+ * Points to LFSPSCQueue, LFMPSCQueue, LFSPMCQueue, or LFMPMCQueue. Enqueue and
+ * dequeue dispatch on the kind of the queue with SPSC as the fast path. Batch
+ * and in place operations are SPSC only, which is asserted.
+ */
 #define LFQueue(T) T*
 
 /** Create generic queue. C only.
@@ -37,11 +67,30 @@
  */
 #define lf_queue(T,/* void* buffer = static_buffer, size_t buffer_length */...) (T*)&LF_OVERLOAD2(__VA_ARGS__, LF_QUEUE_WITH_BUFFER, LF_QUEUE_WOUT_BUFFER,)(T,__VA_ARGS__)
 
+/** Create generic multi producer queue. C only.
+ * Like lf_queue(), but @p sequences must also be provided with @p buffer. It
+ * must hold @p buffer_length zero initialized LFAtomic(LFUint).
+ */
+#define lf_mpsc_queue(T,/* void* buffer = static_buffer, LFAtomic(LFUint)* sequences = static_buffer, size_t buffer_length */...) \
+    (T*)&LF_OVERLOAD3(__VA_ARGS__, LF_MPSC_QUEUE_WITH_BUFFER,, LF_MPSC_QUEUE_WOUT_BUFFER,)(T,__VA_ARGS__)
+
+/** Create generic multi consumer queue. C only.
+ * Like lf_mpsc_queue().
+ */
+#define lf_spmc_queue(T,/* void* buffer = static_buffer, LFAtomic(LFUint)* sequences = static_buffer, size_t buffer_length */...) \
+    (T*)&LF_OVERLOAD3(__VA_ARGS__, LF_SPMC_QUEUE_WITH_BUFFER,, LF_SPMC_QUEUE_WOUT_BUFFER,)(T,__VA_ARGS__)
+
+/** Create generic multi producer multi consumer queue. C only.
+ * Like lf_mpsc_queue().
+ */
+#define lf_mpmc_queue(T,/* void* buffer = static_buffer, LFAtomic(LFUint)* sequences = static_buffer, size_t buffer_length */...) \
+    (T*)&LF_OVERLOAD3(__VA_ARGS__, LF_MPMC_QUEUE_WITH_BUFFER,, LF_MPMC_QUEUE_WOUT_BUFFER,)(T,__VA_ARGS__)
+
 /** Generic enqueue.
  * @return `true` if @p elem got successfully enqueued, `false` if queue was
  * full, in which case the element was not queued.
  */
-#define lf_enqueue(/* LFQueue(T) */queue,/* T */elem) lf_spsc_enqueue((LFSPSCQueue*)(queue), &(struct { LF_TYPEOF(*(queue))_; }) { elem }, sizeof(elem))
+#define lf_enqueue(/* LFQueue(T) */queue,/* T */elem) lf_queue_enqueue((LFSPSCQueue*)(queue), &(struct { LF_TYPEOF(*(queue))_; }) { elem }, sizeof(elem))
 
 /** Generic dequeue.
  * @return @p out if @p queue was not empty, `NULL` otherwise. If @p out is not
@@ -49,6 +98,43 @@
  */
 #define lf_dequeue(/* LFQueue(T) queue, T* out = static_buffer */...) LF_OVERLOAD2(__VA_ARGS__, LF_DEQUEUE_WITH_BUFFER, LF_DEQUEUE_WOUT_BUFFER,)(__VA_ARGS__)
 
+/** Generic batch enqueue.
+ * Enqueues up to @p count elements from array @p elems.
+ * @return number of elements enqueued, which is less than @p count if queue got
+ * full.
+ */
+#define lf_enqueue_n(/* LFQueue(T) */queue,/* const T* */elems,/* size_t */count) \
+    lf_spsc_enqueue_n(lf_queue_spsc(queue), (elems), sizeof(*(queue) = *(elems)), (count))
+
+/** Generic batch dequeue.
+ * Dequeues up to @p count elements to array @p out.
+ * @return number of elements dequeued, which is less than @p count if queue got
+ * empty.
+ */
+#define lf_dequeue_n(/* LFQueue(T) */queue,/* T* */out,/* size_t */count) \
+    lf_spsc_dequeue_n(lf_queue_spsc(queue), (out), sizeof(*(out) = *(queue)), (count))
+
+/** Generic in place enqueue.
+ * @return pointer to the next free element in @p queue to be written to, or
+ * `NULL` if queue was full. The element is not visible to the consumer before
+ * lf_commit().
+ */
+#define lf_reserve(/* LFQueue(T) */queue) \
+    ((LF_TYPEOF(queue))lf_spsc_reserve(lf_queue_spsc(queue), sizeof(*(queue))))
+
+/** Publish element returned by lf_reserve().*/
+#define lf_commit(/* LFQueue(T) */queue) lf_spsc_commit(lf_queue_spsc(queue))
+
+/** Generic in place dequeue.
+ * @return pointer to the oldest element in @p queue, or `NULL` if queue was
+ * empty. The element stays valid and in the queue until lf_release().
+ */
+#define lf_peek(/* LFQueue(T) */queue) \
+    ((LF_TYPEOF(queue))lf_spsc_peek(lf_queue_spsc(queue), sizeof(*(queue))))
+
+/** Remove element returned by lf_peek().*/
+#define lf_release(/* LFQueue(T) */queue) lf_spsc_release(lf_queue_spsc(queue))
+
 // ------------------------------------------------------------
 // Wait-free Single Producer Single Consumer queue
 
@@ -56,12 +142,18 @@ static_assert(ATOMIC_SHORT_LOCK_FREE == 2, "No suitable lock-free integers avail
 #if ATOMIC_LLONG_LOCK_FREE == 2
 /** Guaranteed lock-free when used as atomic.*/
 typedef unsigned long long LFUint;
+/** Signed LFUint.*/
+typedef long long LFInt;
 #elif ATOMIC_INT_LOCK_FREE == 2
 /** Guaranteed lock-free when used as atomic.*/
 typedef unsigned LFUint;
+/** Signed LFUint.*/
+typedef int LFInt;
 #else
 /** Guaranteed lock-free when used as atomic.*/
 typedef unsigned short LFUint;
+/** Signed LFUint.*/
+typedef short LFInt;
 #endif
 
 #if !__cplusplus
@@ -76,34 +168,121 @@ typedef unsigned short LFUint;
 
 #if __GNUC__
 #define LF_NONNULL_ARGS(...) __attribute__((nonnull (__VA_ARGS__)))
+#define LF_LIKELY(X) __builtin_expect(!!(X), 1)
+#define LF_UNLIKELY(X) __builtin_expect(!!(X), 0)
 #else
 #define LF_NONNULL_ARGS(...)
+#define LF_LIKELY(X) (X)
+#define LF_UNLIKELY(X) (X)
 #endif
 
+/** Tells generic macros which queue they operate on.*/
+typedef enum lf_queue_kind
+{
+    LF_SPSC, // zero, so zero initialized LFSPSCQueue is valid
+    LF_MPSC,
+    LF_SPMC,
+    LF_MPMC,
+} LFQueueKind;
+
+/** NUMA placement of queue memory.*/
+typedef enum lf_numa_policy
+{
+    LF_NUMA_DEFAULT,     // not placed by lfc, zero initialized queues have this
+    LF_NUMA_BIND,        // memory bound to numa_node with mbind()
+    LF_NUMA_FIRST_TOUCH, // mbind() failed, memory touched from creating thread
+} LFNumaPolicy;
+
 // TODO document these too.
 
 typedef struct lf_spsc_queue
 {
+    // Read-only after creation. Kept away from the indices so reading these
+    // does not cause cache misses when the other side writes its index. All
+    // queues start with these so generic macros can read kind.
+    alignas(64) void* buffer;
+    size_t buffer_length;
+    LFQueueKind kind;
+    LFNumaPolicy numa_policy; // set by lf_spsc_new_numa()
+    int numa_node;
+    #ifdef LF_LATENCY
+    // Optional instrumentation. If timestamps is not NULL, it must hold
+    // buffer_length elements, which get the time of enqueueing. If latency is
+    // also not NULL, dequeueing records the time elements spent in queue.
+    uint64_t* timestamps;
+    struct lf_histogram* latency;
+    #endif
+
+    // Producer cache line. tail_cache is the producers last seen value of tail,
+    // which is only reloaded when the queue looks full.
     alignas(64) LFAtomic(LFUint) head;
+    LFUint tail_cache;
+    #ifdef LF_STATS
+    // Optional counters, only written by the producer. See lf_spsc_stats().
+    LFAtomic(LFUint) enqueued;
+    LFAtomic(LFUint) full;
+    LFAtomic(LFUint) bytes_enqueued;
+    LFAtomic(LFUint) max_occupancy;
+    size_t reserved_size;
+    #endif
+
+    // Consumer cache line. head_cache is the consumers last seen value of head,
+    // which is only reloaded when the queue looks empty.
     alignas(64) LFAtomic(LFUint) tail;
-    void*  buffer;
-    size_t buffer_length;
+    LFUint head_cache;
+    #ifdef LF_STATS
+    // Optional counters, only written by the consumer.
+    LFAtomic(LFUint) dequeued;
+    LFAtomic(LFUint) empty;
+    LFAtomic(LFUint) bytes_dequeued;
+    size_t peeked_size;
+    #endif
+
+    // Used by waiting operations. The flags are only written when a side goes
+    // to sleep, and the futex words only when a sleeping side is woken up.
+    alignas(64) LFAtomic(unsigned) producer_waiting;
+    LFAtomic(unsigned) consumer_waiting;
+    LFAtomic(unsigned) not_full;
+    LFAtomic(unsigned) not_empty;
 } LFSPSCQueue;
 
 static inline LFUint lf_index(LFUint x, LFUint queue_buffer_size);
+static inline void lf_spin_hint(void);
+static inline void lf_futex_wait(LFAtomic(unsigned)*, unsigned expected);
+static inline void lf_futex_wake(LFAtomic(unsigned)*);
+static inline void lf_light_fence(void);
+static inline void lf_heavy_fence(void);
+static inline void lf_copy_in(void*, size_t, LFUint, const void*LF_RESTRICT, size_t, size_t);
+static inline void lf_copy_out(void*LF_RESTRICT, const void*, size_t, LFUint, size_t, size_t);
+static inline void lf_spsc_stamp(LFSPSCQueue*, LFUint first, size_t count);
+static inline void lf_spsc_record(LFSPSCQueue*, LFUint first, size_t count);
+static inline void lf_spsc_count_enqueue(LFSPSCQueue*, LFUint new_head, size_t count, size_t size);
+static inline void lf_spsc_count_full(LFSPSCQueue*);
+static inline void lf_spsc_count_dequeue(LFSPSCQueue*, size_t count, size_t size);
+static inline void lf_spsc_count_empty(LFSPSCQueue*);
+#if LF_LINUX
+static inline bool lf_huge_advise(void*, size_t);
+#endif
 
 LF_NONNULL_ARGS()
 static inline bool lf_spsc_enqueue(LFSPSCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
 {
     LF_USING_NAMESPACE_STD;
-    LFUint old_head = atomic_load_explicit(&queue->head, memory_order_acquire);
-    if (lf_index(old_head, queue->buffer_length) ==
-        lf_index(atomic_load_explicit(&queue->tail, memory_order_relaxed) - 1, queue->buffer_length))
-        return false;
+    LFUint old_head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (lf_index(old_head, queue->buffer_length) == lf_index(queue->tail_cache - 1, queue->buffer_length))
+    {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (lf_index(old_head, queue->buffer_length) == lf_index(queue->tail_cache - 1, queue->buffer_length)) {
+            lf_spsc_count_full(queue);
+            return false;
+        }
+    }
 
     memcpy((char*)queue->buffer + data_size * lf_index(old_head, queue->buffer_length), data, data_size);
+    lf_spsc_stamp(queue, old_head, 1);
     LFUint new_head = old_head + 1;
     atomic_store_explicit(&queue->head, new_head, memory_order_release);
+    lf_spsc_count_enqueue(queue, new_head, 1, data_size);
 
     return true;
 }
@@ -112,53 +291,3213 @@ LF_NONNULL_ARGS()
 static inline void* lf_spsc_dequeue(LFSPSCQueue* queue, void*LF_RESTRICT out, size_t out_size)
 {
     LF_USING_NAMESPACE_STD;
-    LFUint old_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
-    if (old_tail == atomic_load_explicit(&queue->head, memory_order_relaxed))
-        return NULL;
+    LFUint old_tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (old_tail == queue->head_cache)
+    {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (old_tail == queue->head_cache) {
+            lf_spsc_count_empty(queue);
+            return NULL;
+        }
+    }
 
+    memcpy(out, (char*)queue->buffer + out_size * lf_index(old_tail, queue->buffer_length), out_size);
+    lf_spsc_record(queue, old_tail, 1);
     LFUint new_tail = old_tail + 1;
     atomic_store_explicit(&queue->tail, new_tail, memory_order_release);
+    lf_spsc_count_dequeue(queue, 1, out_size);
 
-    memcpy(out, (char*)queue->buffer + out_size * lf_index(old_tail, queue->buffer_length), out_size);
     return out;
 }
 
+/** Enqueue up to @p count elements of size @p data_size from @p data.
+ * The whole batch is published with a single release store, so this is much
+ * faster than calling lf_spsc_enqueue() in a loop.
+ * @return number of elements enqueued.
+ */
+LF_NONNULL_ARGS()
+static inline size_t lf_spsc_enqueue_n(LFSPSCQueue* queue, const void*LF_RESTRICT data, size_t data_size, size_t count)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t available = queue->buffer_length - 1 - (LFUint)(head - queue->tail_cache);
+    if (count > available) {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        available = queue->buffer_length - 1 - (LFUint)(head - queue->tail_cache);
+        if (count > available) {
+            lf_spsc_count_full(queue);
+            count = available;
+        }
+    }
+    if (count == 0)
+        return 0;
 
-// ----------------------------------------------------------------------------
-//
-//          END OF API REFERENCE
-//
-//          Code below is for internal usage and may change without notice.
-//
-// ----------------------------------------------------------------------------
+    lf_copy_in(queue->buffer, queue->buffer_length, lf_index(head, queue->buffer_length), data, data_size, count);
+    lf_spsc_stamp(queue, head, count);
+    atomic_store_explicit(&queue->head, (LFUint)(head + count), memory_order_release);
+    lf_spsc_count_enqueue(queue, head + count, count, count * data_size);
 
+    return count;
+}
 
-static inline LFUint lf_index(LFUint x, LFUint queue_buffer_size)
+/** Dequeue up to @p count elements of size @p out_size to @p out.
+ * The whole batch is released with a single release store, so this is much
+ * faster than calling lf_spsc_dequeue() in a loop.
+ * @return number of elements dequeued.
+ */
+LF_NONNULL_ARGS()
+static inline size_t lf_spsc_dequeue_n(LFSPSCQueue* queue, void*LF_RESTRICT out, size_t out_size, size_t count)
 {
-    const bool queue_buffer_size_is_power_of_2 = (queue_buffer_size & (queue_buffer_size - 1)) == 0;
-    assert(queue_buffer_size_is_power_of_2); (void)queue_buffer_size_is_power_of_2;
-    assert(queue_buffer_size > 0);
-    return x & (queue_buffer_size - 1);
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t available = (LFUint)(queue->head_cache - tail);
+    if (count > available) {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        available = (LFUint)(queue->head_cache - tail);
+        if (count > available)
+            count = available;
+    }
+    if (count == 0) {
+        lf_spsc_count_empty(queue);
+        return 0;
+    }
+
+    lf_copy_out(out, queue->buffer, queue->buffer_length, lf_index(tail, queue->buffer_length), out_size, count);
+    lf_spsc_record(queue, tail, count);
+    atomic_store_explicit(&queue->tail, (LFUint)(tail + count), memory_order_release);
+    lf_spsc_count_dequeue(queue, count, count * out_size);
+
+    return count;
 }
 
-#if __STDC_VERSION__ >= 202311L
-#define LF_TYPEOF(...) typeof(__VA_ARGS__)
-#elif __cplusplus
-#define LF_TYPEOF(...) decltype(__VA_ARGS__)
-#else
-#define LF_TYPEOF(...) __typeof__(__VA_ARGS__)
+/** Get the next free slot to construct an element of size @p data_size in
+ * place. Only the producer may call this. Calling it again before
+ * lf_spsc_commit() returns the same slot.
+ * @return pointer to slot in buffer or `NULL` if queue was full.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spsc_reserve(LFSPSCQueue* queue, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (lf_index(head, queue->buffer_length) == lf_index(queue->tail_cache - 1, queue->buffer_length))
+    {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (lf_index(head, queue->buffer_length) == lf_index(queue->tail_cache - 1, queue->buffer_length)) {
+            lf_spsc_count_full(queue);
+            return NULL;
+        }
+    }
+    #ifdef LF_STATS
+    queue->reserved_size = data_size;
+    #endif
+    return (char*)queue->buffer + data_size * lf_index(head, queue->buffer_length);
+}
+
+/** Publish slot returned by lf_spsc_reserve().*/
+LF_NONNULL_ARGS()
+static inline void lf_spsc_commit(LFSPSCQueue* queue)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    lf_spsc_stamp(queue, head, 1);
+    atomic_store_explicit(&queue->head, (LFUint)(head + 1), memory_order_release);
+    #ifdef LF_STATS
+    lf_spsc_count_enqueue(queue, head + 1, 1, queue->reserved_size);
+    #endif
+}
+
+/** Get the oldest element of size @p out_size without copying it.
+ * Only the consumer may call this. The element stays in the queue and can be
+ * read and modified in place until lf_spsc_release().
+ * @return pointer to element in buffer or `NULL` if queue was empty.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spsc_peek(LFSPSCQueue* queue, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail == queue->head_cache)
+    {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail == queue->head_cache) {
+            lf_spsc_count_empty(queue);
+            return NULL;
+        }
+    }
+    #ifdef LF_STATS
+    queue->peeked_size = out_size;
+    #endif
+    return (char*)queue->buffer + out_size * lf_index(tail, queue->buffer_length);
+}
+
+/** Remove element returned by lf_spsc_peek() giving the slot back to producer.*/
+LF_NONNULL_ARGS()
+static inline void lf_spsc_release(LFSPSCQueue* queue)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    lf_spsc_record(queue, tail, 1);
+    atomic_store_explicit(&queue->tail, (LFUint)(tail + 1), memory_order_release);
+    #ifdef LF_STATS
+    lf_spsc_count_dequeue(queue, 1, queue->peeked_size);
+    #endif
+}
+
+// Number of tries before waiting operations go to sleep.
+#ifndef LF_SPIN_COUNT
+#define LF_SPIN_COUNT 1024
 #endif
 
-#define LF_OVERLOAD2(_0, _1, RESOLVED, ...) RESOLVED
+/** Enqueue waiting for space if queue is full.
+ * Spins LF_SPIN_COUNT times and then sleeps until consumer dequeues. On Linux,
+ * sleeping uses futexes and costs no CPU time, elsewhere it keeps spinning.
+ * Waiting operations only wake up the other side if it uses waiting operations
+ * as well. Checking if the other side is sleeping costs a relaxed load and,
+ * on Linux 4.14 or later, no memory fence: the side going to sleep pays for
+ * both with membarrier(). Elsewhere a full fence is used.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_spsc_enqueue_wait(LFSPSCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    for (unsigned i = 0; ! lf_spsc_enqueue(queue, data, data_size); ++i)
+    {
+        if (i < LF_SPIN_COUNT) {
+            lf_spin_hint();
+            continue;
+        }
+        // Read futex word before announcing so any wake after the check
+        // below makes futex wait return immediately.
+        unsigned not_full = atomic_load_explicit(&queue->not_full, memory_order_relaxed);
+        atomic_store_explicit(&queue->producer_waiting, 1, memory_order_relaxed);
+        lf_heavy_fence();
+        if (lf_spsc_enqueue(queue, data, data_size))
+            break;
+        lf_futex_wait(&queue->not_full, not_full);
+    }
+    atomic_store_explicit(&queue->producer_waiting, 0, memory_order_relaxed);
 
-#define LF_QUEUE_WOUT_BUFFER(T, BUFFER_LENGTH) \
-    (LFSPSCQueue){.buffer = (T[BUFFER_LENGTH]){0}, .buffer_length = (BUFFER_LENGTH) }
-#define LF_QUEUE_WITH_BUFFER(T, BUFFER, BUFFER_LENGTH) \
-    (LFSPSCQueue){.buffer = (BUFFER), .buffer_length = (BUFFER_LENGTH) }
+    lf_light_fence(); // pairs with lf_heavy_fence() of the sleeping side
+    if (LF_UNLIKELY(atomic_load_explicit(&queue->consumer_waiting, memory_order_relaxed))) {
+        atomic_fetch_add_explicit(&queue->not_empty, 1, memory_order_relaxed);
+        lf_futex_wake(&queue->not_empty);
+    }
+}
+
+/** Dequeue waiting for an element if queue is empty.
+ * Counterpart of lf_spsc_enqueue_wait().
+ * @return @p out.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spsc_dequeue_wait(LFSPSCQueue* queue, void*LF_RESTRICT out, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    for (unsigned i = 0; lf_spsc_dequeue(queue, out, out_size) == NULL; ++i)
+    {
+        if (i < LF_SPIN_COUNT) {
+            lf_spin_hint();
+            continue;
+        }
+        unsigned not_empty = atomic_load_explicit(&queue->not_empty, memory_order_relaxed);
+        atomic_store_explicit(&queue->consumer_waiting, 1, memory_order_relaxed);
+        lf_heavy_fence();
+        if (lf_spsc_dequeue(queue, out, out_size) != NULL)
+            break;
+        lf_futex_wait(&queue->not_empty, not_empty);
+    }
+    atomic_store_explicit(&queue->consumer_waiting, 0, memory_order_relaxed);
+
+    lf_light_fence(); // pairs with lf_heavy_fence() of the sleeping side
+    if (LF_UNLIKELY(atomic_load_explicit(&queue->producer_waiting, memory_order_relaxed))) {
+        atomic_fetch_add_explicit(&queue->not_full, 1, memory_order_relaxed);
+        lf_futex_wake(&queue->not_full);
+    }
+    return out;
+}
+
+#ifdef LF_STATS
+/** Snapshot of LFSPSCQueue counters, only available if LF_STATS is defined.*/
+typedef struct lf_queue_stats
+{
+    LFUint enqueued;       // elements enqueued
+    LFUint full;           // enqueue operations that found the queue full
+    LFUint bytes_enqueued;
+    LFUint max_occupancy;  // upper bound of most elements in queue
+    LFUint dequeued;       // elements dequeued
+    LFUint empty;          // dequeue operations that found the queue empty
+    LFUint bytes_dequeued;
+} LFQueueStats;
+
+/** Read counters of @p queue.
+ * Can be called from any thread. Counters are read separately, so they might
+ * not be consistent with each other if the queue is in use. Batch enqueues
+ * that only partly fit count as full, and batch dequeues as empty only if
+ * nothing got dequeued. Waiting operations count each failed try. Occupancy is
+ * measured against the producers cached tail, so it is never below the real
+ * value. Only LFSPSCQueue has counters, other queues and rings do not.
+ */
+LF_NONNULL_ARGS()
+static inline LFQueueStats lf_spsc_stats(const LFSPSCQueue* queue)
+{
+    LF_USING_NAMESPACE_STD;
+    LFQueueStats stats;
+    stats.enqueued       = atomic_load_explicit(&queue->enqueued,       memory_order_relaxed);
+    stats.full           = atomic_load_explicit(&queue->full,           memory_order_relaxed);
+    stats.bytes_enqueued = atomic_load_explicit(&queue->bytes_enqueued, memory_order_relaxed);
+    stats.max_occupancy  = atomic_load_explicit(&queue->max_occupancy,  memory_order_relaxed);
+    stats.dequeued       = atomic_load_explicit(&queue->dequeued,       memory_order_relaxed);
+    stats.empty          = atomic_load_explicit(&queue->empty,          memory_order_relaxed);
+    stats.bytes_dequeued = atomic_load_explicit(&queue->bytes_dequeued, memory_order_relaxed);
+    return stats;
+}
+#endif // LF_STATS
+
+// ------------------------------------------------------------
+// Multi Producer Multi Consumer queue
+
+/** Bounded MPMC queue.
+ * Every slot has a sequence number telling if it is free or written for the
+ * current lap, so producers only contend on head and consumers only on tail.
+ * Initialize with zeroes and set @p buffer, @p sequences and @p buffer_length,
+ * which must be a power of 2 and at least 2, and @p kind to LF_MPMC if you
+ * want to use the generic macros. @p sequences must hold @p buffer_length zero
+ * initialized elements.
+ */
+typedef struct lf_mpmc_queue
+{
+    // Read-only after creation.
+    alignas(64) void* buffer;
+    size_t buffer_length;
+    LFQueueKind kind;
+    LFAtomic(LFUint)* sequences;
+
+    // Producers cache line.
+    alignas(64) LFAtomic(LFUint) head;
+
+    // Consumers cache line.
+    alignas(64) LFAtomic(LFUint) tail;
+} LFMPMCQueue;
+
+/** Enqueue from any thread.
+ * @return `true` if element got enqueued, `false` if queue was full.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_mpmc_enqueue(LFMPMCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    LFUint index, lap;
+    while (true)
+    {
+        index = lf_index(head, queue->buffer_length);
+        lap   = head - index;
+        LFInt diff = (LFInt)(LFUint)(atomic_load_explicit(&queue->sequences[index], memory_order_acquire) - lap);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                &queue->head, &head, (LFUint)(head + 1), memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // slot still holds element from last lap
+            return false;
+        else
+            head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+
+    memcpy((char*)queue->buffer + data_size * index, data, data_size);
+    atomic_store_explicit(&queue->sequences[index], (LFUint)(lap + 1), memory_order_release);
+
+    return true;
+}
+
+/** Dequeue from any thread.
+ * @return @p out if queue was not empty, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_mpmc_dequeue(LFMPMCQueue* queue, void*LF_RESTRICT out, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    LFUint index, lap;
+    while (true)
+    {
+        index = lf_index(tail, queue->buffer_length);
+        lap   = tail - index;
+        LFInt diff = (LFInt)(LFUint)(atomic_load_explicit(&queue->sequences[index], memory_order_acquire) - (lap + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                &queue->tail, &tail, (LFUint)(tail + 1), memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // slot not written yet
+            return NULL;
+        else
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+
+    memcpy(out, (char*)queue->buffer + out_size * index, out_size);
+    atomic_store_explicit(&queue->sequences[index], (LFUint)(lap + queue->buffer_length), memory_order_release);
+
+    return out;
+}
+
+// ------------------------------------------------------------
+// Multi Producer Single Consumer queue
+
+/** Bounded MPSC queue.
+ * Same layout and producer side as LFMPMCQueue, which it is an alias of, so
+ * the two can be used interchangeably. Only the consumer side differs: with a
+ * single consumer there is nothing to compete for, so lf_mpsc_dequeue() is
+ * wait-free. Initialize like LFMPMCQueue and set @p kind to LF_MPSC if you
+ * want to use the generic macros.
+ */
+typedef LFMPMCQueue LFMPSCQueue;
+
+/** Enqueue from any thread.
+ * Same as lf_mpmc_enqueue().
+ * @return `true` if element got enqueued, `false` if queue was full.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_mpsc_enqueue(LFMPSCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
+{
+    return lf_mpmc_enqueue(queue, data, data_size);
+}
+
+/** Dequeue from the consumer thread.
+ * @return @p out if queue was not empty, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_mpsc_dequeue(LFMPSCQueue* queue, void*LF_RESTRICT out, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail  = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    LFUint index = lf_index(tail, queue->buffer_length);
+    LFUint lap   = tail - index;
+    if (atomic_load_explicit(&queue->sequences[index], memory_order_acquire) != (LFUint)(lap + 1))
+        return NULL; // empty or producer still writing
+
+    memcpy(out, (char*)queue->buffer + out_size * index, out_size);
+    atomic_store_explicit(&queue->sequences[index], (LFUint)(lap + queue->buffer_length), memory_order_release);
+    atomic_store_explicit(&queue->tail, (LFUint)(tail + 1), memory_order_release);
+
+    return out;
+}
+
+// ------------------------------------------------------------
+// Single Producer Multi Consumer queue
+
+/** Bounded SPMC queue.
+ * Alias of LFMPMCQueue like LFMPSCQueue, but specialized on the producer side
+ * instead: the producer only checks the sequence number of its next slot, so
+ * lf_spmc_enqueue() is wait-free. Consumers compete for elements exactly like
+ * in LFMPMCQueue. Initialize like LFMPMCQueue and set @p kind to LF_SPMC if
+ * you want to use the generic macros.
+ */
+typedef LFMPMCQueue LFSPMCQueue;
+
+/** Enqueue from the producer thread.
+ * @return `true` if element got enqueued, `false` if queue was full.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_spmc_enqueue(LFSPMCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head  = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    LFUint index = lf_index(head, queue->buffer_length);
+    LFUint lap   = head - index;
+    if (atomic_load_explicit(&queue->sequences[index], memory_order_acquire) != lap)
+        return false; // full or consumer still reading
+
+    memcpy((char*)queue->buffer + data_size * index, data, data_size);
+    atomic_store_explicit(&queue->sequences[index], (LFUint)(lap + 1), memory_order_release);
+    atomic_store_explicit(&queue->head, (LFUint)(head + 1), memory_order_relaxed);
+
+    return true;
+}
+
+/** Dequeue from any consumer thread.
+ * Same as lf_mpmc_dequeue().
+ * @return @p out if queue was not empty, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spmc_dequeue(LFSPMCQueue* queue, void*LF_RESTRICT out, size_t out_size)
+{
+    return lf_mpmc_dequeue(queue, out, out_size);
+}
+
+// ------------------------------------------------------------
+// Wait-free Single Producer Single Consumer variable length record ring
+
+// Alignment of records in LFSPSCRing. Must be a power of 2 and at least
+// sizeof(size_t), which is also the size of record headers. Define your own
+// value if you need stricter alignment for your records.
+#ifndef LF_RING_ALIGNMENT
+#define LF_RING_ALIGNMENT sizeof(size_t)
+#endif
+
+/** Byte oriented ring of variable length records.
+ * Each record is stored contiguously with a length header, records that do not
+ * fit before the end of buffer are moved to the beginning. Initialize with
+ * zeroes and set @p buffer and @p buffer_size. @p buffer_size is in bytes and
+ * must be a power of 2. @p buffer must be aligned to LF_RING_ALIGNMENT.
+ * Records larger than half of @p buffer_size including header never fit.
+ */
+typedef struct lf_spsc_ring
+{
+    // Read-only after creation.
+    alignas(64) void* buffer;
+    size_t buffer_size;
+
+    // Producer cache line. reserved is head after lf_spsc_ring_reserve().
+    alignas(64) LFAtomic(LFUint) head;
+    LFUint tail_cache;
+    LFUint reserved;
+
+    // Consumer cache line. peeked is tail after lf_spsc_ring_peek().
+    alignas(64) LFAtomic(LFUint) tail;
+    LFUint head_cache;
+    LFUint peeked;
+} LFSPSCRing;
+
+static inline size_t lf_ring_record_size(size_t data_size);
+
+/** Get contiguous memory for a record of @p data_size bytes.
+ * Only the producer may call this. The record is not visible to the consumer
+ * before lf_spsc_ring_commit().
+ * @return pointer to record aligned to LF_RING_ALIGNMENT or `NULL` if there
+ * was not enough space.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spsc_ring_reserve(LFSPSCRing* ring, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    size_t record_size = lf_ring_record_size(data_size);
+    if (record_size > ring->buffer_size / 2)
+        return NULL;
+
+    LFUint head  = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    LFUint index = lf_index(head, ring->buffer_size);
+    size_t to_end = ring->buffer_size - index;
+    size_t needed = record_size <= to_end ? record_size : to_end + record_size;
+    if ((LFUint)(head - ring->tail_cache) + needed > ring->buffer_size)
+    {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if ((LFUint)(head - ring->tail_cache) + needed > ring->buffer_size)
+            return NULL;
+    }
+
+    if (record_size > to_end) { // skip to beginning of buffer
+        const size_t wrap = (size_t)-1;
+        memcpy((char*)ring->buffer + index, &wrap, sizeof wrap);
+        index = 0;
+    }
+    memcpy((char*)ring->buffer + index, &data_size, sizeof data_size);
+    ring->reserved = head + needed;
+    return (char*)ring->buffer + index + LF_RING_ALIGNMENT;
+}
+
+/** Publish record returned by lf_spsc_ring_reserve().*/
+LF_NONNULL_ARGS()
+static inline void lf_spsc_ring_commit(LFSPSCRing* ring)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_store_explicit(&ring->head, ring->reserved, memory_order_release);
+}
+
+/** Copy @p data_size bytes from @p data to a new record.
+ * @return `true` if record got pushed, `false` if there was not enough space.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_spsc_ring_push(LFSPSCRing* ring, const void*LF_RESTRICT data, size_t data_size)
+{
+    void* record = lf_spsc_ring_reserve(ring, data_size);
+    if (record == NULL)
+        return false;
+    memcpy(record, data, data_size);
+    lf_spsc_ring_commit(ring);
+    return true;
+}
+
+/** Get the oldest record without copying it.
+ * Only the consumer may call this. The record stays valid until
+ * lf_spsc_ring_release().
+ * @return pointer to record and its length in @p out_size, or `NULL` if ring
+ * was empty.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_spsc_ring_peek(LFSPSCRing* ring, size_t* out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == ring->head_cache)
+    {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_cache)
+            return NULL;
+    }
+
+    LFUint index = lf_index(tail, ring->buffer_size);
+    size_t data_size;
+    memcpy(&data_size, (char*)ring->buffer + index, sizeof data_size);
+    if (data_size == (size_t)-1) { // wrapped, record is always published with the marker
+        tail += ring->buffer_size - index;
+        index = 0;
+        memcpy(&data_size, ring->buffer, sizeof data_size);
+    }
+    ring->peeked = tail + lf_ring_record_size(data_size);
+    *out_size = data_size;
+    return (char*)ring->buffer + index + LF_RING_ALIGNMENT;
+}
+
+/** Remove record returned by lf_spsc_ring_peek().*/
+LF_NONNULL_ARGS()
+static inline void lf_spsc_ring_release(LFSPSCRing* ring)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_store_explicit(&ring->tail, ring->peeked, memory_order_release);
+}
+
+// ------------------------------------------------------------
+// Single Producer broadcast ring
+
+/** Position of a consumer in a ring shared by multiple consumers.
+ * Each cursor is on its own cache line so consumers do not slow each other
+ * down. barrier_cache is the consumers last seen value of the sequence it must
+ * not pass, which is only reloaded when the cursor catches up with it.
+ */
+typedef struct lf_cursor
+{
+    alignas(64) LFAtomic(LFUint) position;
+    LFUint barrier_cache;
+    LFAtomic(unsigned) state; // LFCursorState, zero initialized is attached
+} LFCursor;
+
+/** @private */
+typedef enum lf_cursor_state
+{
+    LF_CURSOR_ATTACHED,
+    LF_CURSOR_DETACHED, // ignored by producer, free for lf_broadcast_register()
+    LF_CURSOR_CLAIMED,  // being registered, still ignored by producer
+} LFCursorState;
+
+/** Ring where every consumer receives every element.
+ * The producer writes each element once and consumers read it at their own
+ * cursors, so the producer can only overwrite elements that all consumers have
+ * received. Initialize with zeroes and set @p buffer, @p buffer_length, and
+ * @p cursors, which must hold @p cursors_length zero initialized cursors. Zero
+ * initialized cursors are attached consumers starting from the first element.
+ * Consumers can join and leave while the ring is in use with
+ * lf_broadcast_register() and lf_broadcast_unregister(), which reuse cursors,
+ * so @p cursors_length is the maximum number of consumers. Unregister cursors
+ * that are not used from the start before publishing. A registered consumer
+ * that stops receiving stops the producer when the ring gets full. Holds up to
+ * @p buffer_length elements.
+ */
+typedef struct lf_broadcast_ring
+{
+    // Read-only after creation.
+    alignas(64) void* buffer;
+    size_t buffer_length;
+    LFCursor* cursors;
+    size_t cursors_length;
+
+    // Producer cache line. tail_cache is the position of the slowest cursor
+    // when last checked, which is only updated when the ring looks full.
+    alignas(64) LFAtomic(LFUint) head;
+    LFUint tail_cache;
+} LFBroadcastRing;
+
+static inline LFUint lf_slowest_cursor(const LFCursor*, size_t cursors_length, LFUint head);
+
+/** Publish copy of @p data to all consumers.
+ * @return `true` if @p data got published, `false` if the slowest consumer had
+ * not yet received the oldest element.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_broadcast_publish(LFBroadcastRing* ring, const void*LF_RESTRICT data, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if ((LFUint)(head - ring->tail_cache) >= ring->buffer_length)
+    {
+        // Cursor being registered may briefly be further behind than the ring
+        // is long, which waits for it like a full ring.
+        ring->tail_cache = lf_slowest_cursor(ring->cursors, ring->cursors_length, head);
+        if ((LFUint)(head - ring->tail_cache) >= ring->buffer_length)
+            return false;
+    }
+
+    memcpy((char*)ring->buffer + data_size * lf_index(head, ring->buffer_length), data, data_size);
+    atomic_store_explicit(&ring->head, (LFUint)(head + 1), memory_order_release);
+    return true;
+}
+
+/** Attach a new consumer to @p ring from any thread.
+ * The consumer receives elements published after this, the producer does not
+ * wait for it before. Reuses a cursor released by lf_broadcast_unregister().
+ * @return cursor owned by the calling consumer or `NULL` if all cursors were
+ * in use.
+ */
+LF_NONNULL_ARGS()
+static inline LFCursor* lf_broadcast_register(LFBroadcastRing* ring)
+{
+    LF_USING_NAMESPACE_STD;
+    for (size_t i = 0; i < ring->cursors_length; ++i)
+    {
+        LFCursor* cursor = &ring->cursors[i];
+        unsigned detached = LF_CURSOR_DETACHED;
+        if ( ! atomic_compare_exchange_strong_explicit(
+            &cursor->state, &detached, (unsigned)LF_CURSOR_CLAIMED, memory_order_acquire, memory_order_relaxed))
+            continue;
+
+        // The producer might not see the cursor yet and keep publishing, so
+        // head is reloaded after attaching. Slots after the reloaded head
+        // cannot be overwritten before the producer sees the cursor.
+        LFUint head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        atomic_store_explicit(&cursor->position, head, memory_order_relaxed);
+        atomic_store_explicit(&cursor->state, (unsigned)LF_CURSOR_ATTACHED, memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst); // pairs with lf_slowest_cursor()
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        atomic_store_explicit(&cursor->position, head, memory_order_release);
+        cursor->barrier_cache = head;
+        return cursor;
+    }
+    return NULL;
+}
+
+/** Detach consumer of @p cursor. The producer stops waiting for it and the
+ * cursor can be reused by lf_broadcast_register(). Only the consumer owning
+ * @p cursor may call this.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_broadcast_unregister(LFBroadcastRing* ring, LFCursor* cursor)
+{
+    LF_USING_NAMESPACE_STD;
+    (void)ring;
+    atomic_store_explicit(&cursor->state, (unsigned)LF_CURSOR_DETACHED, memory_order_release);
+}
+
+/** Get the next element for the consumer of @p cursor without copying it.
+ * Only the consumer owning @p cursor may call this. The element stays valid
+ * until lf_broadcast_release() and must not be modified, since other consumers
+ * read the same element.
+ * @return pointer to element in buffer or `NULL` if there was nothing new.
+ */
+LF_NONNULL_ARGS()
+static inline const void* lf_broadcast_peek(LFBroadcastRing* ring, LFCursor* cursor, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint position = atomic_load_explicit(&cursor->position, memory_order_relaxed);
+    if (position == cursor->barrier_cache)
+    {
+        cursor->barrier_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (position == cursor->barrier_cache)
+            return NULL;
+    }
+    return (const char*)ring->buffer + out_size * lf_index(position, ring->buffer_length);
+}
+
+/** Move @p cursor past element returned by lf_broadcast_peek().*/
+LF_NONNULL_ARGS()
+static inline void lf_broadcast_release(LFBroadcastRing* ring, LFCursor* cursor)
+{
+    LF_USING_NAMESPACE_STD;
+    (void)ring;
+    LFUint position = atomic_load_explicit(&cursor->position, memory_order_relaxed);
+    atomic_store_explicit(&cursor->position, (LFUint)(position + 1), memory_order_release);
+}
+
+/** Copy the next element for the consumer of @p cursor to @p out.
+ * Only the consumer owning @p cursor may call this.
+ * @return @p out if there was a new element, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_broadcast_receive(LFBroadcastRing* ring, LFCursor* cursor, void*LF_RESTRICT out, size_t out_size)
+{
+    const void* element = lf_broadcast_peek(ring, cursor, out_size);
+    if (element == NULL)
+        return NULL;
+    memcpy(out, element, out_size);
+    lf_broadcast_release(ring, cursor);
+    return out;
+}
+
+
+// ------------------------------------------------------------
+// Single Producer multi-stage pipeline
+
+/** Ring processed in place by a chain of stages.
+ * Stage 0 sees elements after the producer commits them, and every following
+ * stage sees elements after the previous stage releases them. The producer can
+ * reuse a slot after the last stage releases it. Stages read and modify elements
+ * in place, so elements are never copied between stages. Initialize with zeroes
+ * and set @p buffer, @p buffer_length, and @p stages, which must hold
+ * @p stages_length zero initialized cursors. Each stage must be run by a single
+ * thread. Holds up to @p buffer_length elements.
+ */
+typedef struct lf_pipeline
+{
+    // Read-only after creation.
+    alignas(64) void* buffer;
+    size_t buffer_length;
+    LFCursor* stages;
+    size_t stages_length;
+
+    // Producer cache line. tail_cache is the last seen position of the last
+    // stage, which is only reloaded when the pipeline looks full.
+    alignas(64) LFAtomic(LFUint) head;
+    LFUint tail_cache;
+} LFPipeline;
+
+/** Get the next free slot to construct an element of size @p data_size in
+ * place. Only the producer may call this. Calling it again before
+ * lf_pipeline_commit() returns the same slot.
+ * @return pointer to slot in buffer or `NULL` if pipeline was full.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_pipeline_reserve(LFPipeline* pipeline, size_t data_size)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+    if ((LFUint)(head - pipeline->tail_cache) == pipeline->buffer_length)
+    {
+        pipeline->tail_cache = atomic_load_explicit(
+            &pipeline->stages[pipeline->stages_length - 1].position, memory_order_acquire);
+        if ((LFUint)(head - pipeline->tail_cache) == pipeline->buffer_length)
+            return NULL;
+    }
+    return (char*)pipeline->buffer + data_size * lf_index(head, pipeline->buffer_length);
+}
+
+/** Pass slot returned by lf_pipeline_reserve() to the first stage.*/
+LF_NONNULL_ARGS()
+static inline void lf_pipeline_commit(LFPipeline* pipeline)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+    atomic_store_explicit(&pipeline->head, (LFUint)(head + 1), memory_order_release);
+}
+
+/** Copy @p data to a new element.
+ * @return `true` if @p data got pushed, `false` if pipeline was full.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_pipeline_push(LFPipeline* pipeline, const void*LF_RESTRICT data, size_t data_size)
+{
+    void* slot = lf_pipeline_reserve(pipeline, data_size);
+    if (slot == NULL)
+        return false;
+    memcpy(slot, data, data_size);
+    lf_pipeline_commit(pipeline);
+    return true;
+}
+
+/** Get the next element for @p stage.
+ * Only the thread running @p stage may call this. The element can be read and
+ * modified until lf_pipeline_release(), after which it belongs to the next
+ * stage.
+ * @return pointer to element in buffer or `NULL` if previous stage had not
+ * released anything new.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_pipeline_peek(LFPipeline* pipeline, size_t stage, size_t out_size)
+{
+    LF_USING_NAMESPACE_STD;
+    assert(stage < pipeline->stages_length);
+    LFCursor* cursor = &pipeline->stages[stage];
+    LFUint position  = atomic_load_explicit(&cursor->position, memory_order_relaxed);
+    if (position == cursor->barrier_cache)
+    {
+        cursor->barrier_cache = atomic_load_explicit(
+            stage == 0 ? &pipeline->head : &pipeline->stages[stage - 1].position, memory_order_acquire);
+        if (position == cursor->barrier_cache)
+            return NULL;
+    }
+    return (char*)pipeline->buffer + out_size * lf_index(position, pipeline->buffer_length);
+}
+
+/** Pass element returned by lf_pipeline_peek() to the next stage.*/
+LF_NONNULL_ARGS()
+static inline void lf_pipeline_release(LFPipeline* pipeline, size_t stage)
+{
+    LF_USING_NAMESPACE_STD;
+    LFCursor* cursor = &pipeline->stages[stage];
+    LFUint position  = atomic_load_explicit(&cursor->position, memory_order_relaxed);
+    atomic_store_explicit(&cursor->position, (LFUint)(position + 1), memory_order_release);
+}
+
+// ------------------------------------------------------------
+// Treiber stack
+
+/** Node of LFStack. Embed it in your own struct.*/
+typedef struct lf_stack_node
+{
+    LFAtomic(struct lf_stack_node*) next;
+} LFStackNode;
+
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16) && UINTPTR_MAX > 0xFFFFFFFF
+#define LF_STACK_DOUBLE_WIDTH 1
+__extension__ typedef unsigned __int128 LFUint128;
+
+/** @private */
+typedef union lf_stack_head
+{
+    LFUint128 whole;
+    struct { LFStackNode* node; uintptr_t tag; } parts;
+} LFStackHead;
+#endif
+
+/** Lock-free LIFO stack of intrusive nodes.
+ * The head is a pointer and a counter that changes on every update, so a node
+ * popped and pushed back between a reading and updating the head does not
+ * corrupt the stack (ABA problem). If the target supports 16 byte
+ * compare-and-swap, e.g. x86-64 with -mcx16, pointer and counter are updated
+ * together. Otherwise they are packed in a single LFUint, which leaves 16 bits
+ * for the counter on 64-bit targets and assumes node addresses fit in the low
+ * 48 bits. This does not hold with 5-level paging (LA57) or with tagged
+ * pointers like ARM TBI and MTE, so in packed mode pushing a node with any of
+ * the high 16 bits set fails and returns `false`. Popping reads the next
+ * pointer of nodes that might have been just popped by other threads, so
+ * popped nodes must stay readable memory, e.g. by being reused for other stacks
+ * or pools, or reclaimed with hazard pointers. Zero initialized stack is empty.
+ */
+typedef struct lf_stack
+{
+    #if LF_STACK_DOUBLE_WIDTH
+    alignas(64) LFStackHead head;
+    #else
+    alignas(64) LFAtomic(LFUint) head;
+    #endif
+} LFStack;
+
+static inline bool lf_stack_swap_head(LFStack*, LFStackNode** old_node, LFUint* old_tag, LFStackNode* new_node);
+static inline LFStackNode* lf_stack_load_head(LFStack*, LFUint* tag);
+static inline bool lf_stack_fits(const void* address);
+
+/** Push linked nodes from @p first to @p last with a single update.
+ * Links from @p first to @p last must be set by the caller, next of @p last
+ * gets overwritten. In packed mode every node in the list is checked, see
+ * LFStack.
+ * @return `true` if nodes got pushed, `false` if an address of a node does not
+ * fit in the packed head, in which case the stack is not modified.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_stack_push_list(LFStack* stack, LFStackNode* first, LFStackNode* last)
+{
+    LF_USING_NAMESPACE_STD;
+    #if ! LF_STACK_DOUBLE_WIDTH
+    for (LFStackNode* node = first; ; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+        if ( ! lf_stack_fits(node))
+            return false;
+        if (node == last)
+            break;
+    }
+    #endif
+    LFUint tag;
+    LFStackNode* head = lf_stack_load_head(stack, &tag);
+    do
+        atomic_store_explicit(&last->next, head, memory_order_relaxed);
+    while ( ! lf_stack_swap_head(stack, &head, &tag, first));
+    return true;
+}
+
+/** Push @p node.
+ * @return `true` if @p node got pushed, `false` if its address does not fit in
+ * the packed head, see LFStack.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_stack_push(LFStack* stack, LFStackNode* node)
+{
+    return lf_stack_push_list(stack, node, node);
+}
+
+/** Pop the most recently pushed node.
+ * @return node or `NULL` if stack was empty.
+ */
+LF_NONNULL_ARGS()
+static inline LFStackNode* lf_stack_pop(LFStack* stack)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tag;
+    LFStackNode* head = lf_stack_load_head(stack, &tag);
+    while (head != NULL && ! lf_stack_swap_head(
+        stack, &head, &tag, atomic_load_explicit(&head->next, memory_order_relaxed)));
+    return head;
+}
+
+/** Pop all nodes at once.
+ * @return the most recently pushed node, which is linked to the rest, or `NULL`
+ * if stack was empty.
+ */
+LF_NONNULL_ARGS()
+static inline LFStackNode* lf_stack_pop_all(LFStack* stack)
+{
+    LFUint tag;
+    LFStackNode* head = lf_stack_load_head(stack, &tag);
+    while (head != NULL && ! lf_stack_swap_head(stack, &head, &tag, NULL));
+    return head;
+}
+
+// ------------------------------------------------------------
+// Typed Single Producer Single Consumer queue
+
+/** Define SPSC queue type @p Name holding up to @p N elements of type @p T.
+ * @p N must be a power of 2. Defines struct @p Name with inline buffer and
+ * functions
+ *     bool Name_enqueue(Name* queue, T elem);
+ *     bool Name_dequeue(Name* queue, T* out);
+ * which return `false` if queue was full or empty respectively. Element size and
+ * capacity are compile time constants, so small elements are copied with
+ * single loads and stores. Zero initialized queue is empty and valid.
+ */
+#define LF_DEFINE_QUEUE(Name, T, N) \
+    typedef struct Name \
+    { \
+        alignas(64) LFAtomic(LFUint) head; \
+        LFUint tail_cache; \
+        alignas(64) LFAtomic(LFUint) tail; \
+        LFUint head_cache; \
+        alignas(64) T buffer[N]; \
+    } Name; \
+    \
+    LF_NONNULL_ARGS() \
+    static inline bool Name##_enqueue(Name* queue, T elem) \
+    { \
+        LF_USING_NAMESPACE_STD; \
+        LFUint old_head = atomic_load_explicit(&queue->head, memory_order_relaxed); \
+        if ((LFUint)(old_head - queue->tail_cache) == (N)) \
+        { \
+            queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire); \
+            if ((LFUint)(old_head - queue->tail_cache) == (N)) \
+                return false; \
+        } \
+        queue->buffer[old_head & ((N) - 1)] = elem; \
+        atomic_store_explicit(&queue->head, (LFUint)(old_head + 1), memory_order_release); \
+        return true; \
+    } \
+    \
+    LF_NONNULL_ARGS() \
+    static inline bool Name##_dequeue(Name* queue, T* out) \
+    { \
+        LF_USING_NAMESPACE_STD; \
+        LFUint old_tail = atomic_load_explicit(&queue->tail, memory_order_relaxed); \
+        if (old_tail == queue->head_cache) \
+        { \
+            queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire); \
+            if (old_tail == queue->head_cache) \
+                return false; \
+        } \
+        *out = queue->buffer[old_tail & ((N) - 1)]; \
+        atomic_store_explicit(&queue->tail, (LFUint)(old_tail + 1), memory_order_release); \
+        return true; \
+    } \
+    \
+    static_assert((N) > 0 && ((N) & ((N) - 1)) == 0, #Name " capacity must be a power of 2.")
+
+#if __cplusplus
+// ------------------------------------------------------------
+// C++ Single Producer Single Consumer queue
+
+namespace lf
+{
+
+/** SPSC queue with compile time element type and capacity.
+ * Holds up to @p N elements, which must be a power of 2. Indexing uses a
+ * constant mask and elements are copied by assignment, so there is no runtime
+ * size or capacity to check.
+ */
+template <typename T, std::size_t N>
+class spsc_queue
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of 2.");
+    static_assert(N <= (LFUint)-1 / 2, "Capacity too large for LFUint.");
+    static constexpr LFUint mask = N - 1;
+
+public:
+    /** @return `true` if @p elem got enqueued, `false` if queue was full.*/
+    bool enqueue(const T& elem)
+    {
+        LFUint old_head = head.load(std::memory_order_relaxed);
+        if ((LFUint)(old_head - tail_cache) == N)
+        {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if ((LFUint)(old_head - tail_cache) == N)
+                return false;
+        }
+        buffer[old_head & mask] = elem;
+        head.store((LFUint)(old_head + 1), std::memory_order_release);
+        return true;
+    }
+
+    /** @return `true` if an element got dequeued to @p out, `false` if queue
+     * was empty.
+     */
+    bool dequeue(T& out)
+    {
+        LFUint old_tail = tail.load(std::memory_order_relaxed);
+        if (old_tail == head_cache)
+        {
+            head_cache = head.load(std::memory_order_acquire);
+            if (old_tail == head_cache)
+                return false;
+        }
+        out = buffer[old_tail & mask];
+        tail.store((LFUint)(old_tail + 1), std::memory_order_release);
+        return true;
+    }
+
+    static constexpr std::size_t capacity() { return N; }
+
+private:
+    alignas(64) std::atomic<LFUint> head{0};
+    LFUint tail_cache = 0;
+
+    alignas(64) std::atomic<LFUint> tail{0};
+    LFUint head_cache = 0;
+
+    alignas(64) T buffer[N];
+};
+
+} // namespace lf
+#endif // __cplusplus
+
+// ------------------------------------------------------------
+// Latency histogram
+
+// Number of sub-buckets per power of 2 is 1 << LF_HISTOGRAM_SUB_BITS, which
+// gives values with relative error less than 1 / (1 << LF_HISTOGRAM_SUB_BITS).
+#ifndef LF_HISTOGRAM_SUB_BITS
+#define LF_HISTOGRAM_SUB_BITS 4
+#endif
+#define LF_HISTOGRAM_LENGTH ((64 - LF_HISTOGRAM_SUB_BITS + 1) << LF_HISTOGRAM_SUB_BITS)
+
+/** Log-linear histogram of 64-bit values.
+ * Zero initialize before use. Recording and querying is thread safe. Define
+ * LF_LATENCY to make LFSPSCQueue record latencies to one.
+ */
+typedef struct lf_histogram
+{
+    LFAtomic(LFUint) counts[LF_HISTOGRAM_LENGTH];
+} LFHistogram;
+
+static inline size_t   lf_histogram_index(uint64_t value);
+static inline uint64_t lf_histogram_lower_bound(size_t index);
+
+LF_NONNULL_ARGS()
+static inline void lf_histogram_record(LFHistogram* histogram, uint64_t value)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_fetch_add_explicit(&histogram->counts[lf_histogram_index(value)], 1, memory_order_relaxed);
+}
+
+/** Value below or at which @p percentile percent of recorded values are.
+ * @return upper bound of the bucket of the value, or 0 if nothing is recorded.
+ */
+LF_NONNULL_ARGS()
+static inline uint64_t lf_histogram_percentile(const LFHistogram* histogram, double percentile)
+{
+    LF_USING_NAMESPACE_STD;
+    uint64_t total = 0;
+    for (size_t i = 0; i < LF_HISTOGRAM_LENGTH; ++i)
+        total += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(percentile / 100. * total + .999999);
+    target = target < 1 ? 1 : target > total ? total : target;
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i < LF_HISTOGRAM_LENGTH - 1; ++i)
+        if ((count += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed)) >= target)
+            break;
+    return i < LF_HISTOGRAM_LENGTH - 1 ? lf_histogram_lower_bound(i + 1) - 1 : UINT64_MAX;
+}
+
+// ------------------------------------------------------------
+// Allocator dependent utilities
+//
+// Utilities below allocate memory with GPAllocator from gpc.h. They are only
+// available if gpc.h is included before lfc.h.
+
+#ifdef GP_MEMORY_INCLUDED
+
+// Allocators only guarantee GP_ALLOC_ALIGNMENT, use these for structs with
+// cache line aligned members.
+static inline void* lf_alloc_aligned(const GPAllocator*, size_t);
+static inline void  lf_dealloc_aligned(const GPAllocator*, void*);
+
+// ------------------------------------------------------------
+// Unbounded Single Producer Single Consumer queue
+
+/** @private */
+typedef struct lf_segment
+{
+    alignas(GP_ALLOC_ALIGNMENT) LFAtomic(struct lf_segment*) next;
+} LFSegment;
+
+/** SPSC queue that grows instead of getting full.
+ * Elements are stored in linked fixed size segments. The producer links in a
+ * new segment when it fills the current one and the consumer gives drained
+ * segments back to the producer to reuse or deallocates them. The allocator is
+ * only used to allocate from the producer thread and deallocate from the
+ * consumer thread, so a plain arena or gp_heap can be used.
+ */
+typedef struct lf_segmented_queue
+{
+    // Read-only after creation.
+    alignas(64) const GPAllocator* allocator;
+    size_t element_size;
+    size_t segment_length;
+
+    // Producer cache line.
+    alignas(64) LFAtomic(LFUint) head;
+    LFSegment* head_segment;
+
+    // Consumer cache line. spare holds a drained segment for producer to
+    // reuse, which is only touched once per segment.
+    alignas(64) LFUint tail;
+    LFUint head_cache;
+    LFSegment* tail_segment;
+    LFAtomic(LFSegment*) spare;
+} LFSegmentedQueue;
+
+/** Initialize queue for elements of size @p element_size.
+ * @p segment_length is the number of elements in a segment and must be a power
+ * of 2.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_segmented_init(
+    LFSegmentedQueue* queue, const GPAllocator* allocator, size_t element_size, size_t segment_length)
+{
+    LF_USING_NAMESPACE_STD;
+    memset((void*)queue, 0, sizeof*queue);
+    queue->allocator      = allocator;
+    queue->element_size   = element_size;
+    queue->segment_length = segment_length;
+    queue->head_segment   = queue->tail_segment = (LFSegment*)gp_mem_alloc(
+        allocator, sizeof(LFSegment) + element_size * segment_length);
+    atomic_store_explicit(&queue->head_segment->next, (LFSegment*)NULL, memory_order_relaxed);
+}
+
+/** Deallocate all segments.*/
+LF_NONNULL_ARGS()
+static inline void lf_segmented_destroy(LFSegmentedQueue* queue)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFSegment* segment = queue->tail_segment; segment != NULL;) {
+        LFSegment* next = atomic_load_explicit(&segment->next, memory_order_relaxed);
+        gp_mem_dealloc(queue->allocator, segment);
+        segment = next;
+    }
+    gp_mem_dealloc(queue->allocator, atomic_load_explicit(&queue->spare, memory_order_relaxed));
+}
+
+/** Enqueue from the producer thread. Always succeeds.*/
+LF_NONNULL_ARGS()
+static inline void lf_segmented_enqueue(LFSegmentedQueue* queue, const void*LF_RESTRICT data)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head  = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    LFUint index = lf_index(head, queue->segment_length);
+    memcpy((char*)(queue->head_segment + 1) + queue->element_size * index, data, queue->element_size);
+
+    if (index == queue->segment_length - 1) // full, link next before publishing last
+    {
+        LFSegment* segment = atomic_exchange_explicit(&queue->spare, (LFSegment*)NULL, memory_order_acquire);
+        if (segment == NULL)
+            segment = (LFSegment*)gp_mem_alloc(
+                queue->allocator, sizeof(LFSegment) + queue->element_size * queue->segment_length);
+        atomic_store_explicit(&segment->next, (LFSegment*)NULL, memory_order_relaxed);
+        atomic_store_explicit(&queue->head_segment->next, segment, memory_order_relaxed);
+        queue->head_segment = segment;
+    }
+    atomic_store_explicit(&queue->head, (LFUint)(head + 1), memory_order_release);
+}
+
+/** Dequeue from the consumer thread.
+ * @return @p out if queue was not empty, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_segmented_dequeue(LFSegmentedQueue* queue, void*LF_RESTRICT out)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint tail = queue->tail;
+    if (tail == queue->head_cache)
+    {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail == queue->head_cache)
+            return NULL;
+    }
+
+    LFUint index = lf_index(tail, queue->segment_length);
+    memcpy(out, (char*)(queue->tail_segment + 1) + queue->element_size * index, queue->element_size);
+    queue->tail = tail + 1;
+
+    if (index == queue->segment_length - 1) // drained, next got linked before head moved past it
+    {
+        LFSegment* drained  = queue->tail_segment;
+        queue->tail_segment = atomic_load_explicit(&drained->next, memory_order_relaxed);
+        gp_mem_dealloc(queue->allocator,
+            atomic_exchange_explicit(&queue->spare, drained, memory_order_release));
+    }
+    return out;
+}
+
+// ------------------------------------------------------------
+// Work-stealing deque
+
+/** @private */
+typedef struct lf_deque_array
+{
+    // Followed by LFAtomic(void*) items[length].
+    struct lf_deque_array* previous; // arrays replaced by growing
+    size_t length;
+} LFDequeArray;
+
+/** Chase-Lev work-stealing deque of pointers.
+ * The owner thread pushes and pops at the bottom like a stack, and any thread
+ * can steal from the top. The owner only needs a compare-and-swap when taking
+ * the last item. The deque grows when full. Thieves may still read the old
+ * array, so replaced arrays are only deallocated by lf_deque_destroy(), which
+ * also makes it fine to use an arena.
+ */
+typedef struct lf_deque
+{
+    // Read-only after creation.
+    alignas(64) const GPAllocator* allocator;
+
+    // Written by thieves and by owner when taking the last item.
+    alignas(64) LFAtomic(LFInt) top;
+
+    // Owner cache line.
+    alignas(64) LFAtomic(LFInt) bottom;
+    LFAtomic(LFDequeArray*) array;
+} LFDeque;
+
+static inline LFAtomic(void*)* lf_deque_items(LFDequeArray*);
+static inline LFDequeArray* lf_deque_grow(LFDeque*, LFDequeArray*, LFInt top, LFInt bottom);
+
+/** Initialize deque with room for @p initial_length items.
+ * @p initial_length must be a power of 2.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_deque_init(LFDeque* deque, const GPAllocator* allocator, size_t initial_length)
+{
+    LF_USING_NAMESPACE_STD;
+    memset((void*)deque, 0, sizeof*deque);
+    deque->allocator = allocator;
+    LFDequeArray* array = (LFDequeArray*)gp_mem_alloc(
+        allocator, sizeof(LFDequeArray) + initial_length * sizeof(LFAtomic(void*)));
+    array->previous = NULL;
+    array->length   = initial_length;
+    atomic_store_explicit(&deque->array, array, memory_order_relaxed);
+}
+
+/** Deallocate all arrays. No thread may use the deque anymore.*/
+LF_NONNULL_ARGS()
+static inline void lf_deque_destroy(LFDeque* deque)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFDequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed); array != NULL;) {
+        LFDequeArray* previous = array->previous;
+        gp_mem_dealloc(deque->allocator, array);
+        array = previous;
+    }
+}
+
+/** Push @p item to the bottom. Only the owner may call this.
+ * @p item must not be `NULL`.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_deque_push(LFDeque* deque, void* item)
+{
+    LF_USING_NAMESPACE_STD;
+    LFInt bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    LFInt top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+    LFDequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > (LFInt)array->length - 1)
+        array = lf_deque_grow(deque, array, top, bottom);
+
+    atomic_store_explicit(&lf_deque_items(array)[lf_index(bottom, array->length)], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/** Pop the most recently pushed item. Only the owner may call this.
+ * @return item or `NULL` if deque was empty.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_deque_pop(LFDeque* deque)
+{
+    LF_USING_NAMESPACE_STD;
+    LFInt bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    LFDequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    LFInt top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) { // empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void* item = atomic_load_explicit(&lf_deque_items(array)[lf_index(bottom, array->length)], memory_order_relaxed);
+    if (top == bottom) // last item, race against thieves
+    {
+        if ( ! atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+            item = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/** Steal the least recently pushed item. Any thread may call this.
+ * @return item or `NULL` if deque was empty or another thread took the item
+ * first, in which case it might be worth trying again.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_deque_steal(LFDeque* deque)
+{
+    LF_USING_NAMESPACE_STD;
+    LFInt top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    LFInt bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+
+    LFDequeArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    void* item = atomic_load_explicit(&lf_deque_items(array)[lf_index(top, array->length)], memory_order_relaxed);
+    if ( ! atomic_compare_exchange_strong_explicit(
+        &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return item;
+}
+
+// ------------------------------------------------------------
+// Hazard pointers
+
+// Number of pointers a thread can protect at once.
+#ifndef LF_HAZARD_SLOTS
+#define LF_HAZARD_SLOTS 2
+#endif
+
+/** Hazard pointers and retired nodes of one thread.
+ * Get one with lf_hazard_acquire(). Records are never deallocated before the
+ * domain, they are reused by other threads after lf_hazard_release().
+ */
+typedef struct lf_hazard_record
+{
+    // Written by owner, read by all threads scanning.
+    alignas(64) LFAtomic(void*) slots[LF_HAZARD_SLOTS];
+    LFAtomic(bool) active;
+    struct lf_hazard_record* next;
+
+    // Owner only.
+    void** retired;
+    size_t retired_length;
+    size_t retired_capacity;
+} LFHazardRecord;
+
+/** Safe memory reclamation for lock-free data structures.
+ * Threads publish pointers they are about to dereference in hazard slots, and
+ * retired nodes are only deallocated when no slot points to them. Retired nodes
+ * are collected per thread and scanned when there are more of them than
+ * max(64, 2 * number of hazard slots in domain), which keeps the cost of a
+ * retire constant on average. Nodes must be allocated with @p allocator, which
+ * must be thread safe if nodes are retired from multiple threads. @p allocator
+ * is only used to deallocate nodes, records and lists of retired nodes are
+ * allocated from gp_heap, so nodes can come from e.g. LFPool.
+ */
+typedef struct lf_hazard_domain
+{
+    // Read-only after creation.
+    alignas(64) const GPAllocator* allocator;
+
+    alignas(64) LFAtomic(LFHazardRecord*) records;
+    LFAtomic(size_t) records_length;
+} LFHazardDomain;
+
+static inline void lf_hazard_scan(LFHazardDomain*, LFHazardRecord*);
+
+/** Initialize empty domain.*/
+LF_NONNULL_ARGS()
+static inline void lf_hazard_init(LFHazardDomain* domain, const GPAllocator* allocator)
+{
+    memset((void*)domain, 0, sizeof*domain);
+    domain->allocator = allocator;
+}
+
+/** Deallocate all retired nodes and records. No thread may use the domain
+ * anymore.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_hazard_destroy(LFHazardDomain* domain)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFHazardRecord* record = atomic_load_explicit(&domain->records, memory_order_acquire); record != NULL;) {
+        LFHazardRecord* next = record->next;
+        for (size_t i = 0; i < record->retired_length; ++i)
+            gp_mem_dealloc(domain->allocator, record->retired[i]);
+        gp_mem_dealloc(gp_heap, record->retired);
+        lf_dealloc_aligned(gp_heap, record);
+        record = next;
+    }
+}
+
+/** Get hazard record for the calling thread.
+ * Reuses a released record if there is one.
+ */
+LF_NONNULL_ARGS()
+static inline LFHazardRecord* lf_hazard_acquire(LFHazardDomain* domain)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFHazardRecord* record = atomic_load_explicit(&domain->records, memory_order_acquire);
+        record != NULL; record = record->next)
+    {
+        bool active = false;
+        if ( ! atomic_load_explicit(&record->active, memory_order_relaxed) &&
+            atomic_compare_exchange_strong_explicit(
+                &record->active, &active, true, memory_order_acquire, memory_order_relaxed))
+            return record;
+    }
+
+    LFHazardRecord* record = (LFHazardRecord*)lf_alloc_aligned(gp_heap, sizeof*record);
+    memset((void*)record, 0, sizeof*record);
+    atomic_store_explicit(&record->active, true, memory_order_relaxed);
+    atomic_fetch_add_explicit(&domain->records_length, 1, memory_order_relaxed);
+    LFHazardRecord* head = atomic_load_explicit(&domain->records, memory_order_relaxed);
+    do
+        record->next = head;
+    while ( ! atomic_compare_exchange_weak_explicit(
+        &domain->records, &head, record, memory_order_release, memory_order_relaxed));
+    return record;
+}
+
+/** Give @p record back to the domain for other threads.
+ * Clears all slots. Nodes retired to @p record still wait for reclamation and
+ * are taken over by the next thread acquiring the record.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_hazard_release(LFHazardRecord* record)
+{
+    LF_USING_NAMESPACE_STD;
+    for (size_t i = 0; i < LF_HAZARD_SLOTS; ++i)
+        atomic_store_explicit(&record->slots[i], (void*)NULL, memory_order_release);
+    atomic_store_explicit(&record->active, false, memory_order_release);
+}
+
+/** Load pointer from @p source and protect it in @p slot.
+ * The returned node will not be deallocated before the slot gets cleared or
+ * overwritten, even if it gets retired.
+ * @return pointer loaded from @p source.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_hazard_protect(LFHazardRecord* record, size_t slot, LFAtomic(void*)* source)
+{
+    LF_USING_NAMESPACE_STD;
+    assert(slot < LF_HAZARD_SLOTS);
+    void* pointer = atomic_load_explicit(source, memory_order_relaxed);
+    while (true)
+    {
+        atomic_store_explicit(&record->slots[slot], pointer, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        void* reloaded = atomic_load_explicit(source, memory_order_acquire);
+        if (reloaded == pointer)
+            return pointer;
+        pointer = reloaded;
+    }
+}
+
+/** Stop protecting pointer in @p slot.*/
+LF_NONNULL_ARGS()
+static inline void lf_hazard_clear(LFHazardRecord* record, size_t slot)
+{
+    LF_USING_NAMESPACE_STD;
+    assert(slot < LF_HAZARD_SLOTS);
+    atomic_store_explicit(&record->slots[slot], (void*)NULL, memory_order_release);
+}
+
+/** Deallocate @p node when no thread protects it anymore.
+ * @p node must already be unreachable for threads that have not protected it.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_hazard_retire(LFHazardDomain* domain, LFHazardRecord* record, void* node)
+{
+    LF_USING_NAMESPACE_STD;
+    if (record->retired_length == record->retired_capacity) {
+        size_t capacity = record->retired_capacity == 0 ? 64 : 2 * record->retired_capacity;
+        record->retired = (void**)gp_mem_realloc(gp_heap, record->retired,
+            record->retired_capacity * sizeof(void*), capacity * sizeof(void*));
+        record->retired_capacity = capacity;
+    }
+    record->retired[record->retired_length++] = node;
+
+    size_t hazards = LF_HAZARD_SLOTS * atomic_load_explicit(&domain->records_length, memory_order_relaxed);
+    if (record->retired_length >= (2 * hazards > 64 ? 2 * hazards : 64))
+        lf_hazard_scan(domain, record);
+}
+
+// ------------------------------------------------------------
+// Epoch-based reclamation
+
+/** Nodes retired in one epoch.*/
+typedef struct lf_epoch_limbo
+{
+    void** nodes;
+    size_t length;
+    size_t capacity;
+    LFUint epoch;
+} LFEpochLimbo;
+
+/** Epoch and retired nodes of one thread.
+ * Get one with lf_epoch_acquire(). Records are never deallocated before the
+ * domain, they are reused by other threads after lf_epoch_release().
+ */
+typedef struct lf_epoch_record
+{
+    // Written by owner, read by all threads advancing the epoch.
+    alignas(64) LFAtomic(LFUint) epoch; // local epoch << 1 | in critical section
+    LFAtomic(bool) active;
+    struct lf_epoch_record* next;
+
+    // Owner only.
+    LFEpochLimbo limbo[3];
+} LFEpochRecord;
+
+/** Safe memory reclamation for read mostly lock-free data structures.
+ * Cheaper for readers than hazard pointers: instead of publishing every
+ * pointer, threads only publish the global epoch when entering a critical
+ * section, after which they can dereference any number of nodes. The epoch
+ * advances when all threads in critical sections have seen it. Retired nodes
+ * are deallocated two epochs later, so they wait in one of three limbo lists
+ * per thread. A thread staying in a critical section blocks reclamation for
+ * all threads. Nodes must be allocated with @p allocator, which must be thread
+ * safe if nodes are retired from multiple threads. Like in LFHazardDomain,
+ * @p allocator only deallocates nodes, records and limbo lists come from
+ * gp_heap.
+ */
+typedef struct lf_epoch_domain
+{
+    // Read-only after creation.
+    alignas(64) const GPAllocator* allocator;
+
+    alignas(64) LFAtomic(LFUint) epoch;
+    alignas(64) LFAtomic(LFEpochRecord*) records;
+} LFEpochDomain;
+
+static inline bool lf_epoch_advance(LFEpochDomain*, LFUint epoch);
+static inline void lf_epoch_reclaim(LFEpochDomain*, LFEpochLimbo*);
+
+/** Initialize empty domain.*/
+LF_NONNULL_ARGS()
+static inline void lf_epoch_init(LFEpochDomain* domain, const GPAllocator* allocator)
+{
+    memset((void*)domain, 0, sizeof*domain);
+    domain->allocator = allocator;
+}
+
+/** Deallocate all retired nodes and records. No thread may use the domain
+ * anymore.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_epoch_destroy(LFEpochDomain* domain)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFEpochRecord* record = atomic_load_explicit(&domain->records, memory_order_acquire); record != NULL;) {
+        LFEpochRecord* next = record->next;
+        for (size_t i = 0; i < 3; ++i) {
+            lf_epoch_reclaim(domain, &record->limbo[i]);
+            gp_mem_dealloc(gp_heap, record->limbo[i].nodes);
+        }
+        lf_dealloc_aligned(gp_heap, record);
+        record = next;
+    }
+}
+
+/** Get epoch record for the calling thread.
+ * Reuses a released record if there is one.
+ */
+LF_NONNULL_ARGS()
+static inline LFEpochRecord* lf_epoch_acquire(LFEpochDomain* domain)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFEpochRecord* record = atomic_load_explicit(&domain->records, memory_order_acquire);
+        record != NULL; record = record->next)
+    {
+        bool active = false;
+        if ( ! atomic_load_explicit(&record->active, memory_order_relaxed) &&
+            atomic_compare_exchange_strong_explicit(
+                &record->active, &active, true, memory_order_acquire, memory_order_relaxed))
+            return record;
+    }
+
+    LFEpochRecord* record = (LFEpochRecord*)lf_alloc_aligned(gp_heap, sizeof*record);
+    memset((void*)record, 0, sizeof*record);
+    atomic_store_explicit(&record->active, true, memory_order_relaxed);
+    LFEpochRecord* head = atomic_load_explicit(&domain->records, memory_order_relaxed);
+    do
+        record->next = head;
+    while ( ! atomic_compare_exchange_weak_explicit(
+        &domain->records, &head, record, memory_order_release, memory_order_relaxed));
+    return record;
+}
+
+/** Give @p record back to the domain for other threads.
+ * Must be outside of critical section. Nodes retired to @p record still wait
+ * for reclamation and are taken over by the next thread acquiring the record.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_epoch_release(LFEpochRecord* record)
+{
+    LF_USING_NAMESPACE_STD;
+    assert( ! (atomic_load_explicit(&record->epoch, memory_order_relaxed) & 1));
+    atomic_store_explicit(&record->active, false, memory_order_release);
+}
+
+/** Begin critical section.
+ * Nodes loaded from shared data structures will not be deallocated before
+ * lf_epoch_exit(), even if they get retired. Critical sections cannot be
+ * nested.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_epoch_enter(LFEpochDomain* domain, LFEpochRecord* record)
+{
+    LF_USING_NAMESPACE_STD;
+    assert( ! (atomic_load_explicit(&record->epoch, memory_order_relaxed) & 1));
+    LFUint epoch = atomic_load_explicit(&domain->epoch, memory_order_relaxed);
+    while (true)
+    {
+        atomic_store_explicit(&record->epoch, epoch << 1 | 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        LFUint reloaded = atomic_load_explicit(&domain->epoch, memory_order_acquire);
+        if (reloaded == epoch)
+            return;
+        epoch = reloaded;
+    }
+}
+
+/** End critical section. Nodes loaded in it may not be dereferenced anymore.*/
+LF_NONNULL_ARGS()
+static inline void lf_epoch_exit(LFEpochRecord* record)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint epoch = atomic_load_explicit(&record->epoch, memory_order_relaxed);
+    assert(epoch & 1);
+    atomic_store_explicit(&record->epoch, epoch & ~(LFUint)1, memory_order_release);
+}
+
+/** Deallocate @p node when no critical section can reference it anymore.
+ * @p node must already be unreachable for threads entering critical sections.
+ * Can be called inside or outside of critical section.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_epoch_retire(LFEpochDomain* domain, LFEpochRecord* record, void* node)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst); // unlinking node before reading epoch
+    LFUint epoch = atomic_load_explicit(&domain->epoch, memory_order_relaxed);
+
+    // Nodes retired 2 epochs ago are not referenced by any critical section.
+    for (size_t i = 0; i < 3; ++i)
+        if (record->limbo[i].length != 0 && record->limbo[i].epoch + 2 <= epoch)
+            lf_epoch_reclaim(domain, &record->limbo[i]);
+
+    LFEpochLimbo* limbo = &record->limbo[epoch % 3];
+    if (limbo->length == limbo->capacity) {
+        size_t capacity = limbo->capacity == 0 ? 64 : 2 * limbo->capacity;
+        limbo->nodes = (void**)gp_mem_realloc(gp_heap, limbo->nodes,
+            limbo->capacity * sizeof(void*), capacity * sizeof(void*));
+        limbo->capacity = capacity;
+    }
+    limbo->nodes[limbo->length++] = node;
+    limbo->epoch = epoch;
+
+    if (limbo->length % 64 == 0)
+        lf_epoch_advance(domain, epoch);
+}
+
+// ------------------------------------------------------------
+// Object pool
+
+// Number of blocks moved between LFPoolCache and LFPool at once.
+#ifndef LF_POOL_BATCH
+#define LF_POOL_BATCH 32
+#endif
+
+/** @private Free block. Blocks in LFPool free list are heads of batches.*/
+typedef struct lf_pool_block
+{
+    LFStackNode node;
+    struct lf_pool_block* batch; // rest of the batch
+} LFPoolBlock;
+
+/** Lock-free allocator for fixed size blocks.
+ * Free blocks are kept in a lock-free stack of batches, so alloc and dealloc
+ * take a few compare-and-swaps without any locks or calls to malloc(). When
+ * empty, blocks are carved from chunks allocated with backing allocator, which
+ * must be thread safe if pool is used from multiple threads. Chunks are only
+ * deallocated by lf_pool_destroy(). Cast to `GPAllocator*` to use with libGPC,
+ * but note that blocks larger than block size cannot be allocated. Use
+ * LFPoolCache for each thread to make allocations cheaper and to avoid
+ * contention. Aborts if a chunk does not fit in packed LFStack.
+ */
+typedef struct lf_pool
+{
+    /** @private */
+    GPAllocator allocator;
+
+    // Read-only after creation.
+    const GPAllocator* backing;
+    size_t block_size;
+    size_t chunk_length;
+
+    LFStack free_list;
+    LFStack chunks;
+} LFPool;
+
+/** Thread local allocator for blocks of LFPool.
+ * Allocates from and deallocates to blocks owned by the calling thread, and
+ * only touches the shared pool once per LF_POOL_BATCH blocks. Blocks can be
+ * deallocated by any cache of the same pool, not just the one allocating them.
+ * Cast to `GPAllocator*` to use with libGPC.
+ */
+typedef struct lf_pool_cache
+{
+    /** @private */
+    GPAllocator allocator;
+
+    LFPool* pool;
+    LFPoolBlock* blocks;
+    LFPoolBlock* freed;
+    size_t freed_length;
+} LFPoolCache;
+
+static inline void* lf_pool_allocator_alloc(const GPAllocator*, size_t);
+static inline void  lf_pool_allocator_dealloc(const GPAllocator*, void*);
+static inline void* lf_pool_cache_allocator_alloc(const GPAllocator*, size_t);
+static inline void  lf_pool_cache_allocator_dealloc(const GPAllocator*, void*);
+static inline LFPoolBlock* lf_pool_take_batch(LFPool*);
+
+/** Initialize empty pool.
+ * @p block_size gets rounded up to fit 2 pointers and GP_ALLOC_ALIGNMENT.
+ * Chunks of @p chunk_length blocks get allocated with @p backing as needed.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_pool_init(LFPool* pool, const GPAllocator* backing, size_t block_size, size_t chunk_length)
+{
+    memset((void*)pool, 0, sizeof*pool);
+    pool->allocator.alloc   = lf_pool_allocator_alloc;
+    pool->allocator.dealloc = lf_pool_allocator_dealloc;
+    pool->backing           = backing;
+    if (block_size < sizeof(LFPoolBlock))
+        block_size = sizeof(LFPoolBlock);
+    pool->block_size   = (block_size + GP_ALLOC_ALIGNMENT - 1) & ~(size_t)(GP_ALLOC_ALIGNMENT - 1);
+    pool->chunk_length = chunk_length != 0 ? chunk_length : 1;
+}
+
+/** Deallocate all chunks. No thread may use the pool or its caches anymore.*/
+LF_NONNULL_ARGS()
+static inline void lf_pool_destroy(LFPool* pool)
+{
+    LF_USING_NAMESPACE_STD;
+    for (LFStackNode* chunk = lf_stack_pop_all(&pool->chunks); chunk != NULL;) {
+        LFStackNode* next = atomic_load_explicit(&chunk->next, memory_order_relaxed);
+        gp_mem_dealloc(pool->backing, chunk);
+        chunk = next;
+    }
+}
+
+/** Allocate block directly from shared free list.*/
+LF_NONNULL_ARGS()
+static inline void* lf_pool_alloc(LFPool* pool)
+{
+    LFPoolBlock* block = lf_pool_take_batch(pool);
+    if (block->batch != NULL)
+        lf_stack_push(&pool->free_list, &block->batch->node);
+    return block;
+}
+
+/** Deallocate block directly to shared free list.*/
+LF_NONNULL_ARGS()
+static inline void lf_pool_dealloc(LFPool* pool, void* block)
+{
+    ((LFPoolBlock*)block)->batch = NULL;
+    lf_stack_push(&pool->free_list, &((LFPoolBlock*)block)->node);
+}
+
+/** Initialize empty cache for calling thread.*/
+LF_NONNULL_ARGS()
+static inline void lf_pool_cache_init(LFPoolCache* cache, LFPool* pool)
+{
+    memset((void*)cache, 0, sizeof*cache);
+    cache->allocator.alloc   = lf_pool_cache_allocator_alloc;
+    cache->allocator.dealloc = lf_pool_cache_allocator_dealloc;
+    cache->pool              = pool;
+}
+
+/** Give all blocks of @p cache back to the pool. Call before thread exits.*/
+LF_NONNULL_ARGS()
+static inline void lf_pool_cache_flush(LFPoolCache* cache)
+{
+    if (cache->blocks != NULL)
+        lf_stack_push(&cache->pool->free_list, &cache->blocks->node);
+    if (cache->freed != NULL)
+        lf_stack_push(&cache->pool->free_list, &cache->freed->node);
+    cache->blocks       = NULL;
+    cache->freed        = NULL;
+    cache->freed_length = 0;
+}
+
+/** Allocate block, preferring the most recently deallocated one.*/
+LF_NONNULL_ARGS()
+static inline void* lf_pool_cache_alloc(LFPoolCache* cache)
+{
+    LFPoolBlock* block;
+    if (cache->freed != NULL) {
+        block = cache->freed;
+        cache->freed = block->batch;
+        --cache->freed_length;
+    } else {
+        if (cache->blocks == NULL)
+            cache->blocks = lf_pool_take_batch(cache->pool);
+        block = cache->blocks;
+        cache->blocks = block->batch;
+    }
+    return block;
+}
+
+/** Deallocate block of the same pool. Full batches go to the pool.*/
+LF_NONNULL_ARGS()
+static inline void lf_pool_cache_dealloc(LFPoolCache* cache, void* block)
+{
+    if (cache->freed_length == LF_POOL_BATCH) {
+        lf_stack_push(&cache->pool->free_list, &cache->freed->node);
+        cache->freed        = NULL;
+        cache->freed_length = 0;
+    }
+    ((LFPoolBlock*)block)->batch = cache->freed;
+    cache->freed = (LFPoolBlock*)block;
+    ++cache->freed_length;
+}
+
+// ------------------------------------------------------------
+// Work-stealing scheduler
+
+// Threads like in thread.h of libGPC, which is only available to gpc.c.
+#if __STDC_VERSION__ >= 201112L && !defined(__MINGW32__) && !defined(__STDC_NO_THREADS__)
+#include <threads.h>
+typedef thrd_t LFThread;
+typedef int    LFThreadResult;
+typedef tss_t  LFThreadKey;
+#define LF_THREAD_SUCCESS thrd_success
+static inline int lf_thread_create(LFThread* t, LFThreadResult(*f)(void*), void* arg)
+{
+    return thrd_create(t, f, arg);
+}
+static inline int lf_thread_join(LFThread t)
+{
+    return thrd_join(t, NULL);
+}
+static inline int lf_thread_key_create(LFThreadKey* key)
+{
+    return tss_create(key, NULL);
+}
+static inline void lf_thread_key_delete(LFThreadKey key)
+{
+    tss_delete(key);
+}
+static inline void* lf_thread_local_get(LFThreadKey key)
+{
+    return tss_get(key);
+}
+static inline int lf_thread_local_set(LFThreadKey key, void* value)
+{
+    return tss_set(key, value);
+}
+#else
+#include <pthread.h>
+typedef pthread_t     LFThread;
+typedef void*         LFThreadResult;
+typedef pthread_key_t LFThreadKey;
+#define LF_THREAD_SUCCESS 0
+static inline int lf_thread_create(LFThread* t, LFThreadResult(*f)(void*), void* arg)
+{
+    return pthread_create(t, NULL, f, arg);
+}
+static inline int lf_thread_join(LFThread t)
+{
+    return pthread_join(t, NULL);
+}
+static inline int lf_thread_key_create(LFThreadKey* key)
+{
+    return pthread_key_create(key, NULL);
+}
+static inline void lf_thread_key_delete(LFThreadKey key)
+{
+    pthread_key_delete(key);
+}
+static inline void* lf_thread_local_get(LFThreadKey key)
+{
+    return pthread_getspecific(key);
+}
+static inline int lf_thread_local_set(LFThreadKey key, void* value)
+{
+    return pthread_setspecific(key, value);
+}
+#endif
+
+/** Task function.*/
+typedef void (*LFTaskFunction)(void* arg);
+
+/** @private */
+typedef struct lf_task
+{
+    LFTaskFunction function;
+    void* arg;
+    struct lf_task_group* group;
+    const GPAllocator* allocator; // deallocates task after running if not NULL
+} LFTask;
+
+/** @private */
+typedef struct lf_worker
+{
+    LFDeque deque;
+    struct lf_scheduler* scheduler;
+    LFThread thread;
+    uint64_t random; // state for picking victims to steal from
+} LFWorker;
+
+/** Fixed size thread pool with work-stealing.
+ * Every worker has its own deque of tasks. Tasks submitted by workers go to the
+ * deque of the submitter, other threads submit to a shared injection queue.
+ * Workers run their own tasks newest first and, when out of tasks, take from
+ * the injection queue or steal the oldest tasks of random other workers. Idle
+ * workers sleep until new tasks are submitted. Tasks can allocate temporary
+ * memory from gp_scratch_arena(), which is rewound after each task.
+ */
+typedef struct lf_scheduler
+{
+    // Read-only after creation.
+    alignas(64) const GPAllocator* allocator;
+    LFWorker* workers;
+    size_t workers_length;
+    void* workers_memory;
+    LFThreadKey worker_key;
+    LFMPMCQueue injection;
+
+    // Idle workers sleep on work_epoch, which is only changed when sleepers
+    // is not zero.
+    alignas(64) LFAtomic(unsigned) work_epoch;
+    LFAtomic(unsigned) sleepers;
+    LFAtomic(bool) stopping;
+} LFScheduler;
+
+/** Set of tasks that can be waited for together.
+ * Initialize with lf_task_group_init().
+ */
+typedef struct lf_task_group
+{
+    LFScheduler* scheduler;
+    LFAtomic(LFUint) pending;
+} LFTaskGroup;
+
+static inline LFThreadResult lf_worker_main(void* worker);
+static inline void lf_scheduler_stop(LFScheduler*, size_t started_length);
+static inline void lf_scheduler_push(LFScheduler*, LFTask*);
+static inline bool lf_scheduler_help(LFScheduler*);
+
+/** Start @p workers_length worker threads.
+ * @p allocator is used to allocate tasks from any thread, so it must be thread
+ * safe, e.g. gp_heap. @p injection_length is the capacity of the queue for
+ * tasks submitted from outside of the workers and must be a power of 2 and at
+ * least 2.
+ * @return `true` on success. `false` if a thread or the thread local key could
+ * not be created, in which case already started workers are stopped, nothing
+ * is left allocated, and @p scheduler must not be destroyed.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_scheduler_init(
+    LFScheduler* scheduler, const GPAllocator* allocator, size_t workers_length, size_t injection_length)
+{
+    LF_USING_NAMESPACE_STD;
+    memset((void*)scheduler, 0, sizeof*scheduler);
+    if (lf_thread_key_create(&scheduler->worker_key) != LF_THREAD_SUCCESS)
+        return false;
+    scheduler->allocator      = allocator;
+    scheduler->workers_length = workers_length;
+    scheduler->workers_memory = gp_mem_alloc(allocator, workers_length * sizeof(LFWorker) + 64);
+    scheduler->workers = (LFWorker*)(((uintptr_t)scheduler->workers_memory + 63) & ~(uintptr_t)63);
+
+    scheduler->injection.buffer        = gp_mem_alloc(allocator, injection_length * sizeof(LFTask*));
+    scheduler->injection.buffer_length = injection_length;
+    scheduler->injection.kind          = LF_MPMC;
+    scheduler->injection.sequences     = (LFAtomic(LFUint)*)gp_mem_alloc_zeroes(
+        allocator, injection_length * sizeof(LFAtomic(LFUint)));
+
+    for (size_t i = 0; i < workers_length; ++i) {
+        LFWorker* worker = &scheduler->workers[i];
+        memset((void*)worker, 0, sizeof*worker);
+        lf_deque_init(&worker->deque, allocator, 256);
+        worker->scheduler = scheduler;
+        worker->random    = i + 1;
+    }
+    for (size_t i = 0; i < workers_length; ++i) {
+        if (lf_thread_create(&scheduler->workers[i].thread, lf_worker_main, &scheduler->workers[i]) != LF_THREAD_SUCCESS) {
+            lf_scheduler_stop(scheduler, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Wait for workers to run out of tasks and stop them.
+ * No thread may submit new tasks after calling this, but running tasks may.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_scheduler_destroy(LFScheduler* scheduler)
+{
+    lf_scheduler_stop(scheduler, scheduler->workers_length);
+}
+
+/** Run @p function with @p arg in one of the workers.*/
+LF_NONNULL_ARGS(1, 2)
+static inline void lf_scheduler_submit(LFScheduler* scheduler, LFTaskFunction function, void* arg)
+{
+    LFTask* task = (LFTask*)gp_mem_alloc(scheduler->allocator, sizeof*task);
+    task->function  = function;
+    task->arg       = arg;
+    task->group     = NULL;
+    task->allocator = scheduler->allocator;
+    lf_scheduler_push(scheduler, task);
+}
+
+/** Initialize empty task group for tasks run by @p scheduler.*/
+LF_NONNULL_ARGS()
+static inline void lf_task_group_init(LFTaskGroup* group, LFScheduler* scheduler)
+{
+    LF_USING_NAMESPACE_STD;
+    group->scheduler = scheduler;
+    atomic_store_explicit(&group->pending, (LFUint)0, memory_order_relaxed);
+}
+
+/** Submit @p function with @p arg as part of @p group.*/
+LF_NONNULL_ARGS(1, 2)
+static inline void lf_task_group_fork(LFTaskGroup* group, LFTaskFunction function, void* arg)
+{
+    LF_USING_NAMESPACE_STD;
+    LFTask* task = (LFTask*)gp_mem_alloc(group->scheduler->allocator, sizeof*task);
+    task->function  = function;
+    task->arg       = arg;
+    task->group     = group;
+    task->allocator = group->scheduler->allocator;
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    lf_scheduler_push(group->scheduler, task);
+}
+
+/** Wait for all tasks forked to @p group to finish.
+ * Instead of blocking, the calling thread runs other tasks while waiting, so
+ * tasks can fork and join recursively without running out of workers.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_task_group_join(LFTaskGroup* group)
+{
+    LF_USING_NAMESPACE_STD;
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) != 0)
+        if ( ! lf_scheduler_help(group->scheduler))
+            lf_spin_hint();
+}
+
+/** Call @p body for ranges covering [0, @p count) in parallel.
+ * The range is split to chunks of @p grain iterations, and @p body gets called
+ * with @p arg and the beginning and end of each chunk. Returns when all chunks
+ * are done.
+ */
+LF_NONNULL_ARGS(1, 4)
+static inline void lf_parallel_for(
+    LFScheduler* scheduler, size_t count, size_t grain, void (*body)(void* arg, size_t begin, size_t end), void* arg);
+
+#endif // GP_MEMORY_INCLUDED
+
+// ------------------------------------------------------------
+// Inter-process Single Producer Single Consumer queue
+
+#if LF_POSIX
+
+#define LF_SHARED_QUEUE_MAGIC 0x4c465351 // "LFSQ"
+
+/** SPSC queue for communicating between processes in shared memory.
+ * The queue header is immediately followed by the buffer and contains no
+ * pointers, so processes can map it to different addresses. Create the queue
+ * with lf_shared_queue_create() in a file descriptor returned by e.g.
+ * memfd_create() or shm_open(), and attach to it from the other process with
+ * lf_shared_queue_attach() after passing the descriptor or the name of the
+ * shared memory object. Holds up to buffer_length elements.
+ */
+typedef struct lf_shared_queue
+{
+    // Read-only after creation. magic is written last so attaching to a queue
+    // that is still being created fails instead of reading garbage.
+    alignas(64) LFAtomic(LFUint) magic;
+    size_t element_size;
+    size_t buffer_length;
+
+    // Producer cache line.
+    alignas(64) LFAtomic(LFUint) head;
+    LFUint tail_cache;
+
+    // Consumer cache line.
+    alignas(64) LFAtomic(LFUint) tail;
+    LFUint head_cache;
+} LFSharedQueue;
+
+/** Size the file referred by @p fd and map a new queue to it.
+ * @p buffer_length must be a power of 2. The file is truncated to fit the queue
+ * exactly and any previous content is discarded.
+ * @return pointer to the mapped queue or `NULL` on failure, in which case errno
+ * is set.
+ */
+static inline LFSharedQueue* lf_shared_queue_create(int fd, size_t element_size, size_t buffer_length)
+{
+    LF_USING_NAMESPACE_STD;
+    if (element_size == 0 || buffer_length == 0 || (buffer_length & (buffer_length - 1)) != 0 ||
+        buffer_length > ((size_t)-1 - sizeof(LFSharedQueue)) / element_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t size = sizeof(LFSharedQueue) + element_size * buffer_length;
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)size) == -1) // zero old content
+        return NULL;
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    LFSharedQueue* queue = (LFSharedQueue*)mapping;
+    memset(mapping, 0, sizeof*queue);
+    queue->element_size  = element_size;
+    queue->buffer_length = buffer_length;
+    atomic_store_explicit(&queue->magic, (LFUint)LF_SHARED_QUEUE_MAGIC, memory_order_release);
+    return queue;
+}
+
+/** Map queue created with lf_shared_queue_create() from @p fd.
+ * @return pointer to the mapped queue or `NULL` on failure, in which case errno
+ * is set. errno is EINVAL if @p fd does not contain a valid queue.
+ */
+static inline LFSharedQueue* lf_shared_queue_attach(int fd)
+{
+    LF_USING_NAMESPACE_STD;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return NULL;
+    if ((size_t)st.st_size < sizeof(LFSharedQueue)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void* mapping = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    LFSharedQueue* queue = (LFSharedQueue*)mapping;
+    size_t buffer_size = (size_t)st.st_size - sizeof*queue;
+    if (atomic_load_explicit(&queue->magic, memory_order_acquire) != LF_SHARED_QUEUE_MAGIC ||
+        queue->element_size == 0 || queue->buffer_length == 0 ||
+        (queue->buffer_length & (queue->buffer_length - 1)) != 0 ||
+        buffer_size % queue->element_size != 0 ||
+        buffer_size / queue->element_size != queue->buffer_length) {
+        munmap(mapping, (size_t)st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return queue;
+}
+
+/** Unmap queue returned by lf_shared_queue_create() or lf_shared_queue_attach().
+ * The queue persists as long as the file does.
+ */
+LF_NONNULL_ARGS()
+static inline void lf_shared_queue_unmap(LFSharedQueue* queue)
+{
+    munmap((void*)queue, sizeof*queue + queue->element_size * queue->buffer_length);
+}
+
+/** Enqueue element of size element_size from @p data.
+ * @return `true` if @p data got enqueued, `false` if queue was full.
+ */
+LF_NONNULL_ARGS()
+static inline bool lf_shared_enqueue(LFSharedQueue* queue, const void*LF_RESTRICT data)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint old_head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if ((LFUint)(old_head - queue->tail_cache) == queue->buffer_length)
+    {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if ((LFUint)(old_head - queue->tail_cache) == queue->buffer_length)
+            return false;
+    }
+
+    memcpy((char*)(queue + 1) + queue->element_size * lf_index(old_head, queue->buffer_length),
+        data, queue->element_size);
+    atomic_store_explicit(&queue->head, (LFUint)(old_head + 1), memory_order_release);
+    return true;
+}
+
+/** Dequeue element of size element_size to @p out.
+ * @return @p out if queue was not empty, `NULL` otherwise.
+ */
+LF_NONNULL_ARGS()
+static inline void* lf_shared_dequeue(LFSharedQueue* queue, void*LF_RESTRICT out)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint old_tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (old_tail == queue->head_cache)
+    {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (old_tail == queue->head_cache)
+            return NULL;
+    }
+
+    memcpy(out, (char*)(queue + 1) + queue->element_size * lf_index(old_tail, queue->buffer_length),
+        queue->element_size);
+    atomic_store_explicit(&queue->tail, (LFUint)(old_tail + 1), memory_order_release);
+    return out;
+}
+
+#endif // LF_POSIX
+
+// ------------------------------------------------------------
+// Huge pages
+
+#if LF_LINUX
+
+#define LF_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Explicit huge pages of the default size may not be 2 MB, so the size is
+// always requested. Defined here for headers older than Linux 3.8.
+#if defined(MAP_HUGETLB) && ! defined(MAP_HUGE_2MB)
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+/** Number of bytes mapped by lf_huge_alloc() for @p size bytes.*/
+static inline size_t lf_huge_size(size_t size)
+{
+    return (size + LF_HUGE_PAGE_SIZE - 1) & ~(size_t)(LF_HUGE_PAGE_SIZE - 1);
+}
+
+/** Allocate @p size bytes backed by huge pages if available.
+ * Tries explicit 2 MB huge pages first and falls back to transparent huge
+ * pages, which may silently fall back to normal pages if the system has them
+ * disabled. Either way exactly lf_huge_size() bytes are mapped. Memory is zero
+ * initialized and aligned to LF_HUGE_PAGE_SIZE, so it can be used as queue
+ * buffer, e.g. `lf_queue(T, lf_huge_alloc(size), size / sizeof(T))`.
+ * @return pointer to memory or `NULL` on failure, in which case errno is set.
+ */
+static inline void* lf_huge_alloc(size_t size)
+{
+    size = lf_huge_size(size);
+    #ifdef MAP_HUGETLB
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mapping != MAP_FAILED)
+        return mapping;
+    #endif
+
+    // Transparent huge pages only back aligned huge pages, so overallocate and
+    // trim the unaligned ends.
+    char* unaligned = (char*)mmap(NULL, size + LF_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void*)unaligned == MAP_FAILED)
+        return NULL;
+    char* aligned = (char*)(((uintptr_t)unaligned + LF_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(LF_HUGE_PAGE_SIZE - 1));
+    if (aligned != unaligned)
+        munmap(unaligned, (size_t)(aligned - unaligned));
+    munmap(aligned + size, (size_t)(unaligned + LF_HUGE_PAGE_SIZE - aligned));
+    lf_huge_advise(aligned, size);
+    return aligned;
+}
+
+/** Free memory returned by lf_huge_alloc() allocated with @p size bytes.
+ * Unmaps lf_huge_size() bytes, the length that was mapped.
+ */
+static inline void lf_huge_free(void* memory, size_t size)
+{
+    if (memory != NULL)
+        munmap(memory, lf_huge_size(size));
+}
+
+/** Advise the kernel to back existing memory with transparent huge pages.
+ * Only the huge pages that fit completely in @p memory are affected. Useful for
+ * memory not allocated by lf_huge_alloc(), like a big arena created with
+ * `GPArena arena = gp_arena_new(capacity);` by passing
+ * `gp_alloc(&arena, 0)` and `capacity` before allocating from it.
+ * @return `true` if advice was taken, `false` otherwise.
+ */
+static inline bool lf_huge_advise(void* memory, size_t size)
+{
+    #ifdef MADV_HUGEPAGE
+    uintptr_t start = ((uintptr_t)memory + LF_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(LF_HUGE_PAGE_SIZE - 1);
+    uintptr_t end   = ((uintptr_t)memory + size) & ~(uintptr_t)(LF_HUGE_PAGE_SIZE - 1);
+    if (end <= start)
+        return false;
+    return madvise((void*)start, end - start, MADV_HUGEPAGE) == 0;
+    #else
+    (void)memory; (void)size;
+    return false;
+    #endif
+}
+
+#ifdef GP_MEMORY_INCLUDED
+static inline void* lf_huge_allocator_alloc(const GPAllocator*, size_t);
+static inline void  lf_huge_allocator_dealloc(const GPAllocator*, void*);
+
+/** Allocator that allocates every block with lf_huge_alloc().
+ * Meant for few big long lived blocks. Blocks are aligned to 64 bytes, and
+ * aborts if out of memory like gp_heap.
+ */
+static inline const GPAllocator* lf_huge_allocator(void)
+{
+    static const GPAllocator allocator = { lf_huge_allocator_alloc, lf_huge_allocator_dealloc };
+    return &allocator;
+}
+#endif // GP_MEMORY_INCLUDED
+
+// ------------------------------------------------------------
+// NUMA
+
+/** @return NUMA node of the CPU the calling thread runs on, or 0 if unknown.*/
+static inline int lf_numa_node(void)
+{
+    unsigned cpu, node;
+    #ifdef SYS_getcpu
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)node;
+    #endif
+    (void)cpu; (void)node;
+    return 0;
+}
+
+/** Create SPSC queue with its memory placed on NUMA node @p node.
+ * The queue and its buffer are allocated together and bound to @p node, which
+ * usually should be the node of the consumer, see lf_numa_node(). If binding is
+ * not supported, the memory is placed by first touch from the calling thread,
+ * so call this from a thread running on @p node. The used policy is stored in
+ * numa_policy. All memory is touched before returning, so there are no page
+ * faults when using the queue. @p buffer_length must be a power of 2.
+ * @return pointer to queue, which must be deleted with lf_spsc_delete_numa(), or
+ * `NULL` on failure, in which case errno is set. errno is EINVAL if
+ * @p buffer_length is not a power of 2, and ENOMEM if the queue size overflows.
+ */
+static inline LFSPSCQueue* lf_spsc_new_numa(size_t element_size, size_t buffer_length, int node)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (buffer_length == 0 || (buffer_length & (buffer_length - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (element_size != 0 && buffer_length > (SIZE_MAX - sizeof(LFSPSCQueue) - page_size) / element_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    const size_t size = (sizeof(LFSPSCQueue) + element_size * buffer_length + page_size - 1) & ~(page_size - 1);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    LFNumaPolicy policy = LF_NUMA_FIRST_TOUCH;
+    #ifdef SYS_mbind
+    unsigned long nodemask[4] = {0};
+    if (node >= 0 && (size_t)node < 8 * sizeof nodemask) {
+        nodemask[node / (8 * sizeof nodemask[0])] = 1ul << node % (8 * sizeof nodemask[0]);
+        if (syscall(SYS_mbind, mapping, size, MPOL_BIND, nodemask, 8 * sizeof nodemask, 0) == 0)
+            policy = LF_NUMA_BIND;
+    }
+    #endif
+    memset(mapping, 0, size);
+
+    LFSPSCQueue* queue   = (LFSPSCQueue*)mapping;
+    queue->buffer        = queue + 1;
+    queue->buffer_length = buffer_length;
+    queue->numa_policy   = policy;
+    queue->numa_node     = node;
+    return queue;
+}
+
+/** Delete queue created with lf_spsc_new_numa() with @p element_size.*/
+static inline void lf_spsc_delete_numa(LFSPSCQueue* queue, size_t element_size)
+{
+    if (queue == NULL)
+        return;
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    munmap((void*)queue, (sizeof*queue + element_size * queue->buffer_length + page_size - 1) & ~(page_size - 1));
+}
+
+#endif // LF_LINUX
+
+// ----------------------------------------------------------------------------
+//
+//          END OF API REFERENCE
+//
+//          Code below is for internal usage and may change without notice.
+//
+// ----------------------------------------------------------------------------
+
+
+static inline LFUint lf_index(LFUint x, LFUint queue_buffer_size)
+{
+    const bool queue_buffer_size_is_power_of_2 = (queue_buffer_size & (queue_buffer_size - 1)) == 0;
+    assert(queue_buffer_size_is_power_of_2); (void)queue_buffer_size_is_power_of_2;
+    assert(queue_buffer_size > 0);
+    return x & (queue_buffer_size - 1);
+}
+
+static_assert(LF_RING_ALIGNMENT >= sizeof(size_t) && (LF_RING_ALIGNMENT & (LF_RING_ALIGNMENT - 1)) == 0,
+    "LF_RING_ALIGNMENT must be a power of 2 and at least sizeof(size_t).");
+
+// Header and data rounded up to LF_RING_ALIGNMENT.
+static inline size_t lf_ring_record_size(size_t data_size)
+{
+    return LF_RING_ALIGNMENT + ((data_size + LF_RING_ALIGNMENT - 1) & ~(size_t)(LF_RING_ALIGNMENT - 1));
+}
+
+static inline void lf_spin_hint(void)
+{
+    #if __GNUC__ && (__x86_64__ || __i386__)
+    __builtin_ia32_pause();
+    #elif __GNUC__ && __aarch64__
+    __asm__ __volatile__ ("yield");
+    #endif
+}
+
+// Sleep while *word == expected. Spurious wakeups are possible.
+static inline void lf_futex_wait(LFAtomic(unsigned)* word, unsigned expected)
+{
+    #if LF_LINUX
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+    #else
+    (void)word; (void)expected;
+    lf_spin_hint();
+    #endif
+}
+
+static inline void lf_futex_wake(LFAtomic(unsigned)* word)
+{
+    #if LF_LINUX
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    #else
+    (void)word;
+    #endif
+}
+
+// Asymmetric Dekker fences. A store followed by a load on both sides needs
+// a full fence on both sides, unless the heavy side makes the other CPUs
+// execute one for it with membarrier(). Registering is a one time syscall done
+// by whichever side comes first, and if it fails both sides use full fences.
+#if LF_LINUX && defined(SYS_membarrier)
+static inline bool lf_membarrier_ready(void)
+{
+    LF_USING_NAMESPACE_STD;
+    static LFAtomic(int) state; // 0 unknown, 1 registered, -1 unsupported
+    int ready = atomic_load_explicit(&state, memory_order_relaxed);
+    if (LF_UNLIKELY(ready == 0)) {
+        ready = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0 ? 1 : -1;
+        atomic_store_explicit(&state, ready, memory_order_relaxed);
+    }
+    return ready == 1;
+}
+#endif
+
+static inline void lf_light_fence(void)
+{
+    LF_USING_NAMESPACE_STD;
+    #if LF_LINUX && defined(SYS_membarrier)
+    if (LF_LIKELY(lf_membarrier_ready())) {
+        atomic_signal_fence(memory_order_seq_cst);
+        return;
+    }
+    #endif
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void lf_heavy_fence(void)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst);
+    #if LF_LINUX && defined(SYS_membarrier)
+    if (lf_membarrier_ready())
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    #endif
+}
+
+static inline uint64_t lf_timestamp(void)
+{
+    #if __GNUC__ && (__x86_64__ || __i386__)
+    return __builtin_ia32_rdtsc();
+    #elif !__cplusplus
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+    #else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    #endif
+}
+
+static inline void lf_spsc_stamp(LFSPSCQueue* queue, LFUint first, size_t count)
+{
+    #ifdef LF_LATENCY
+    if (queue->timestamps == NULL)
+        return;
+    uint64_t now = lf_timestamp();
+    for (size_t i = 0; i < count; ++i)
+        queue->timestamps[lf_index(first + i, queue->buffer_length)] = now;
+    #else
+    (void)queue; (void)first; (void)count;
+    #endif
+}
+
+static inline void lf_spsc_record(LFSPSCQueue* queue, LFUint first, size_t count)
+{
+    #ifdef LF_LATENCY
+    if (queue->timestamps == NULL || queue->latency == NULL)
+        return;
+    uint64_t now = lf_timestamp();
+    for (size_t i = 0; i < count; ++i)
+        lf_histogram_record(queue->latency, now - queue->timestamps[lf_index(first + i, queue->buffer_length)]);
+    #else
+    (void)queue; (void)first; (void)count;
+    #endif
+}
+
+#ifdef LF_STATS
+// Counters have a single writer, so no read-modify-write is needed.
+static inline void lf_stats_add(LFAtomic(LFUint)* counter, LFUint value)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+#endif
+
+static inline void lf_spsc_count_enqueue(LFSPSCQueue* queue, LFUint new_head, size_t count, size_t size)
+{
+    #ifdef LF_STATS
+    LF_USING_NAMESPACE_STD;
+    lf_stats_add(&queue->enqueued, count);
+    lf_stats_add(&queue->bytes_enqueued, size);
+    // tail_cache instead of tail keeps the consumer cache line out of the
+    // producer, so this is an upper bound.
+    LFUint occupancy = new_head - queue->tail_cache;
+    if (occupancy > atomic_load_explicit(&queue->max_occupancy, memory_order_relaxed))
+        atomic_store_explicit(&queue->max_occupancy, occupancy, memory_order_relaxed);
+    #else
+    (void)queue; (void)new_head; (void)count; (void)size;
+    #endif
+}
+
+static inline void lf_spsc_count_full(LFSPSCQueue* queue)
+{
+    #ifdef LF_STATS
+    lf_stats_add(&queue->full, 1);
+    #else
+    (void)queue;
+    #endif
+}
+
+static inline void lf_spsc_count_dequeue(LFSPSCQueue* queue, size_t count, size_t size)
+{
+    #ifdef LF_STATS
+    lf_stats_add(&queue->dequeued, count);
+    lf_stats_add(&queue->bytes_dequeued, size);
+    #else
+    (void)queue; (void)count; (void)size;
+    #endif
+}
+
+static inline void lf_spsc_count_empty(LFSPSCQueue* queue)
+{
+    #ifdef LF_STATS
+    lf_stats_add(&queue->empty, 1);
+    #else
+    (void)queue;
+    #endif
+}
+
+// Position of the attached cursor furthest behind head. Positions are compared
+// by their distance to head so this works when indices wrap around.
+static inline LFUint lf_slowest_cursor(const LFCursor* cursors, size_t cursors_length, LFUint head)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst); // pairs with lf_broadcast_register()
+    LFUint slowest = head;
+    for (size_t i = 0; i < cursors_length; ++i) {
+        if (atomic_load_explicit(&cursors[i].state, memory_order_acquire) != LF_CURSOR_ATTACHED)
+            continue;
+        LFUint position = atomic_load_explicit(&cursors[i].position, memory_order_acquire);
+        if ((LFUint)(head - position) > (LFUint)(head - slowest))
+            slowest = position;
+    }
+    return slowest;
+}
+
+#ifdef GP_MEMORY_INCLUDED
+static inline LFAtomic(void*)* lf_deque_items(LFDequeArray* array)
+{
+    return (LFAtomic(void*)*)(array + 1);
+}
+
+// Double the size of array keeping the old one alive for thieves.
+static inline LFDequeArray* lf_deque_grow(LFDeque* deque, LFDequeArray* array, LFInt top, LFInt bottom)
+{
+    LF_USING_NAMESPACE_STD;
+    LFDequeArray* grown = (LFDequeArray*)gp_mem_alloc(
+        deque->allocator, sizeof(LFDequeArray) + 2 * array->length * sizeof(LFAtomic(void*)));
+    grown->previous = array;
+    grown->length   = 2 * array->length;
+    for (LFInt i = top; i < bottom; ++i)
+        atomic_store_explicit(&lf_deque_items(grown)[lf_index(i, grown->length)],
+            atomic_load_explicit(&lf_deque_items(array)[lf_index(i, array->length)], memory_order_relaxed),
+            memory_order_relaxed);
+    atomic_store_explicit(&deque->array, grown, memory_order_release);
+    return grown;
+}
+#endif
+
+#ifdef GP_MEMORY_INCLUDED
+// Run task rewinding the scratch arena after it. The task is done after group
+// is notified, so nothing may touch it afterwards.
+static inline void lf_task_run(LFTask* task)
+{
+    LF_USING_NAMESPACE_STD;
+    GPArena* scratch = gp_scratch_arena();
+    void* scratch_position = gp_mem_alloc((const GPAllocator*)scratch, 0);
+    LFTaskGroup* group = task->group;
+
+    task->function(task->arg);
+
+    gp_arena_rewind(scratch, scratch_position);
+    if (task->allocator != NULL)
+        gp_mem_dealloc(task->allocator, task);
+    if (group != NULL)
+        atomic_fetch_sub_explicit(&group->pending, 1, memory_order_release);
+}
+
+static inline LFWorker* lf_current_worker(LFScheduler* scheduler)
+{
+    return (LFWorker*)lf_thread_local_get(scheduler->worker_key);
+}
+
+// xorshift64
+static inline uint64_t lf_worker_random(LFWorker* worker)
+{
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+    return worker->random;
+}
+
+// Own tasks first, then injected, then stolen. self is NULL for other threads.
+static inline LFTask* lf_scheduler_find(LFScheduler* scheduler, LFWorker* self)
+{
+    LFTask* task;
+    if (self != NULL && (task = (LFTask*)lf_deque_pop(&self->deque)) != NULL)
+        return task;
+    if (lf_mpmc_dequeue(&scheduler->injection, &task, sizeof task) != NULL)
+        return task;
+
+    size_t start = self != NULL ? lf_worker_random(self) % scheduler->workers_length : 0;
+    for (size_t i = 0; i < scheduler->workers_length; ++i) {
+        LFWorker* victim = &scheduler->workers[(start + i) % scheduler->workers_length];
+        if (victim != self && (task = (LFTask*)lf_deque_steal(&victim->deque)) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+// Wake a worker if any sleep. Pairs with the fence in lf_worker_main() so
+// either the worker sees the task or this sees the sleeper.
+static inline void lf_scheduler_notify(LFScheduler* scheduler)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&scheduler->sleepers, memory_order_relaxed) != 0) {
+        atomic_fetch_add_explicit(&scheduler->work_epoch, 1, memory_order_relaxed);
+        lf_futex_wake(&scheduler->work_epoch);
+    }
+}
+
+static inline void lf_scheduler_push(LFScheduler* scheduler, LFTask* task)
+{
+    LFWorker* self = lf_current_worker(scheduler);
+    if (self != NULL)
+        lf_deque_push(&self->deque, task);
+    else while ( ! lf_mpmc_enqueue(&scheduler->injection, &task, sizeof task)) {
+        lf_scheduler_notify(scheduler);
+        lf_spin_hint();
+    }
+    lf_scheduler_notify(scheduler);
+}
+
+// Run one task if any found.
+static inline bool lf_scheduler_help(LFScheduler* scheduler)
+{
+    LFTask* task = lf_scheduler_find(scheduler, lf_current_worker(scheduler));
+    if (task == NULL)
+        return false;
+    lf_task_run(task);
+    return true;
+}
+
+static inline LFThreadResult lf_worker_main(void* _worker)
+{
+    LF_USING_NAMESPACE_STD;
+    LFWorker* worker = (LFWorker*)_worker;
+    LFScheduler* scheduler = worker->scheduler;
+    lf_thread_local_set(scheduler->worker_key, worker);
+
+    for (unsigned tries = 0; ; ++tries)
+    {
+        LFTask* task = lf_scheduler_find(scheduler, worker);
+        if (task != NULL) {
+            lf_task_run(task);
+            tries = 0;
+            continue;
+        }
+        if (tries < LF_SPIN_COUNT) {
+            lf_spin_hint();
+            continue;
+        }
+
+        unsigned epoch = atomic_load_explicit(&scheduler->work_epoch, memory_order_relaxed);
+        atomic_fetch_add_explicit(&scheduler->sleepers, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((task = lf_scheduler_find(scheduler, worker)) != NULL) {
+            atomic_fetch_sub_explicit(&scheduler->sleepers, 1, memory_order_relaxed);
+            lf_task_run(task);
+            tries = 0;
+            continue;
+        }
+        if (atomic_load_explicit(&scheduler->stopping, memory_order_relaxed)) {
+            atomic_fetch_sub_explicit(&scheduler->sleepers, 1, memory_order_relaxed);
+            break;
+        }
+        lf_futex_wait(&scheduler->work_epoch, epoch);
+        atomic_fetch_sub_explicit(&scheduler->sleepers, 1, memory_order_relaxed);
+    }
+    return (LFThreadResult)0;
+}
+
+// Stop and join the first started_length workers and free everything.
+static inline void lf_scheduler_stop(LFScheduler* scheduler, size_t started_length)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_store_explicit(&scheduler->stopping, true, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&scheduler->work_epoch, 1, memory_order_seq_cst);
+    for (size_t i = 0; i < started_length; ++i)
+        lf_futex_wake(&scheduler->work_epoch);
+    for (size_t i = 0; i < started_length; ++i)
+        lf_thread_join(scheduler->workers[i].thread);
+    for (size_t i = 0; i < scheduler->workers_length; ++i)
+        lf_deque_destroy(&scheduler->workers[i].deque);
+    gp_mem_dealloc(scheduler->allocator, scheduler->workers_memory);
+    gp_mem_dealloc(scheduler->allocator, scheduler->injection.buffer);
+    gp_mem_dealloc(scheduler->allocator, (void*)scheduler->injection.sequences);
+    lf_thread_key_delete(scheduler->worker_key);
+}
+
+typedef struct lf_parallel_for_chunk
+{
+    void (*body)(void* arg, size_t begin, size_t end);
+    void* arg;
+    size_t begin;
+    size_t end;
+    LFTask task;
+} LFParallelForChunk;
+
+static inline void lf_parallel_for_chunk(void* _chunk)
+{
+    LFParallelForChunk* chunk = (LFParallelForChunk*)_chunk;
+    chunk->body(chunk->arg, chunk->begin, chunk->end);
+}
+
+static inline void lf_parallel_for(
+    LFScheduler* scheduler, size_t count, size_t grain, void (*body)(void* arg, size_t begin, size_t end), void* arg)
+{
+    LF_USING_NAMESPACE_STD;
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+    const size_t chunks_length = count / grain + (count % grain != 0);
+    LFParallelForChunk* chunks = (LFParallelForChunk*)gp_mem_alloc(
+        scheduler->allocator, chunks_length * sizeof chunks[0]);
+
+    LFTaskGroup group;
+    lf_task_group_init(&group, scheduler);
+    atomic_store_explicit(&group.pending, (LFUint)chunks_length, memory_order_relaxed);
+    for (size_t i = 0; i < chunks_length; ++i) {
+        LFParallelForChunk* chunk = &chunks[i];
+        chunk->body  = body;
+        chunk->arg   = arg;
+        chunk->begin = i * grain;
+        chunk->end   = count - chunk->begin < grain ? count : chunk->begin + grain;
+        chunk->task.function  = lf_parallel_for_chunk;
+        chunk->task.arg       = chunk;
+        chunk->task.group     = &group;
+        chunk->task.allocator = NULL;
+        lf_scheduler_push(scheduler, &chunk->task);
+    }
+    lf_task_group_join(&group);
+    gp_mem_dealloc(scheduler->allocator, chunks);
+}
+#endif
+
+#if LF_STACK_DOUBLE_WIDTH
+// Halves are loaded separately, torn reads just make the next swap fail.
+static inline LFStackNode* lf_stack_load_head(LFStack* stack, LFUint* tag)
+{
+    *tag = __atomic_load_n(&stack->head.parts.tag, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&stack->head.parts.node, __ATOMIC_ACQUIRE);
+}
+
+static inline bool lf_stack_fits(const void* address)
+{
+    (void)address;
+    return true;
+}
+
+// Replace head if it still is old_node and old_tag incrementing the tag.
+// Otherwise load current head to old_node and old_tag.
+static inline bool lf_stack_swap_head(LFStack* stack, LFStackNode** old_node, LFUint* old_tag, LFStackNode* new_node)
+{
+    LFStackHead expected, desired, current;
+    expected.parts.node = *old_node;
+    expected.parts.tag  = *old_tag;
+    desired.parts.node  = new_node;
+    desired.parts.tag   = *old_tag + 1;
+    current.whole = __sync_val_compare_and_swap(&stack->head.whole, expected.whole, desired.whole);
+    if (current.whole == expected.whole)
+        return true;
+    *old_node = current.parts.node;
+    *old_tag  = current.parts.tag;
+    return false;
+}
+#else
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define LF_STACK_TAG_SHIFT 48 // user space addresses fit in 48 bits
+#else
+#define LF_STACK_TAG_SHIFT 32
+#endif
+static_assert(sizeof(LFUint) * 8 >= LF_STACK_TAG_SHIFT + 16, "No lock-free integer wide enough for LFStack.");
+
+// Packed head has no room for the high bits of address.
+static inline bool lf_stack_fits(const void* address)
+{
+    return (uintptr_t)address >> (LF_STACK_TAG_SHIFT - 1) >> 1 == 0;
+}
+
+static inline LFStackNode* lf_stack_unpack(LFUint head)
+{
+    return (LFStackNode*)(uintptr_t)(head & (((LFUint)1 << LF_STACK_TAG_SHIFT) - 1));
+}
+
+static inline LFStackNode* lf_stack_load_head(LFStack* stack, LFUint* tag)
+{
+    LF_USING_NAMESPACE_STD;
+    LFUint head = atomic_load_explicit(&stack->head, memory_order_acquire);
+    *tag = head >> LF_STACK_TAG_SHIFT;
+    return lf_stack_unpack(head);
+}
+
+static inline bool lf_stack_swap_head(LFStack* stack, LFStackNode** old_node, LFUint* old_tag, LFStackNode* new_node)
+{
+    LF_USING_NAMESPACE_STD;
+    assert(lf_stack_fits(new_node));
+    LFUint expected = (LFUint)(uintptr_t)*old_node | *old_tag << LF_STACK_TAG_SHIFT;
+    LFUint desired  = (LFUint)(uintptr_t)new_node  | (*old_tag + 1) << LF_STACK_TAG_SHIFT;
+    if (atomic_compare_exchange_weak_explicit(
+        &stack->head, &expected, desired, memory_order_acq_rel, memory_order_acquire))
+        return true;
+    *old_node = lf_stack_unpack(expected);
+    *old_tag  = expected >> LF_STACK_TAG_SHIFT;
+    return false;
+}
+#endif
+
+#ifdef GP_MEMORY_INCLUDED
+// Align to 64 bytes storing the original pointer right before the aligned
+// block. Allocated blocks are at least pointer aligned, so there is always room
+// for it.
+static inline void* lf_alloc_aligned(const GPAllocator* allocator, size_t size)
+{
+    void* memory = gp_mem_alloc(allocator, size + 64);
+    void** block = (void**)(((uintptr_t)memory + 64) & ~(uintptr_t)63);
+    block[-1] = memory;
+    return block;
+}
+
+static inline void lf_dealloc_aligned(const GPAllocator* allocator, void* block)
+{
+    if (block != NULL)
+        gp_mem_dealloc(allocator, ((void**)block)[-1]);
+}
+
+static inline int lf_compare_pointers(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t)*(void*const*)a;
+    uintptr_t y = (uintptr_t)*(void*const*)b;
+    return (x > y) - (x < y);
+}
+
+// Deallocate retired nodes of record that are not in any slot. Hazards are
+// collected to scratch arena and sorted, so scanning is O(R log H).
+static inline void lf_hazard_scan(LFHazardDomain* domain, LFHazardRecord* record)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst); // pairs with lf_hazard_protect()
+
+    // Records are only added to the front, so records not in this snapshot
+    // were created after the retired nodes got unreachable.
+    LFHazardRecord* records = atomic_load_explicit(&domain->records, memory_order_acquire);
+    size_t records_length = 0;
+    for (LFHazardRecord* other = records; other != NULL; other = other->next)
+        ++records_length;
+
+    GPArena* scratch = gp_scratch_arena();
+    void** hazards = (void**)gp_mem_alloc((const GPAllocator*)scratch, LF_HAZARD_SLOTS * records_length * sizeof(void*));
+    size_t hazards_length = 0;
+    for (LFHazardRecord* other = records; other != NULL; other = other->next) {
+        for (size_t i = 0; i < LF_HAZARD_SLOTS; ++i) {
+            void* hazard = atomic_load_explicit(&other->slots[i], memory_order_acquire);
+            if (hazard != NULL)
+                hazards[hazards_length++] = hazard;
+        }
+    }
+    qsort(hazards, hazards_length, sizeof hazards[0], lf_compare_pointers);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < record->retired_length; ++i) {
+        void* node = record->retired[i];
+        if (bsearch(&node, hazards, hazards_length, sizeof hazards[0], lf_compare_pointers) != NULL)
+            record->retired[kept++] = node;
+        else
+            gp_mem_dealloc(domain->allocator, node);
+    }
+    record->retired_length = kept;
+    gp_arena_rewind(scratch, hazards);
+}
+#endif
+
+#ifdef GP_MEMORY_INCLUDED
+// Increment global epoch if all threads in critical sections have seen it.
+static inline bool lf_epoch_advance(LFEpochDomain* domain, LFUint epoch)
+{
+    LF_USING_NAMESPACE_STD;
+    atomic_thread_fence(memory_order_seq_cst); // pairs with lf_epoch_enter()
+    for (LFEpochRecord* record = atomic_load_explicit(&domain->records, memory_order_acquire);
+        record != NULL; record = record->next)
+    {
+        LFUint local = atomic_load_explicit(&record->epoch, memory_order_acquire);
+        if ((local & 1) && local >> 1 != epoch)
+            return false;
+    }
+    return atomic_compare_exchange_strong_explicit(
+        &domain->epoch, &epoch, epoch + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+static inline void lf_epoch_reclaim(LFEpochDomain* domain, LFEpochLimbo* limbo)
+{
+    for (size_t i = 0; i < limbo->length; ++i)
+        gp_mem_dealloc(domain->allocator, limbo->nodes[i]);
+    limbo->length = 0;
+}
+#endif
+
+#ifdef GP_MEMORY_INCLUDED
+// Pop batch of free blocks or carve a new chunk to a batch.
+static inline LFPoolBlock* lf_pool_take_batch(LFPool* pool)
+{
+    LFStackNode* node = lf_stack_pop(&pool->free_list);
+    if (node != NULL)
+        return (LFPoolBlock*)node;
+
+    const size_t header_size = (sizeof(LFStackNode) + GP_ALLOC_ALIGNMENT - 1) & ~(size_t)(GP_ALLOC_ALIGNMENT - 1);
+    const size_t chunk_size  = header_size + pool->chunk_length * pool->block_size;
+    LFStackNode* chunk = (LFStackNode*)gp_mem_alloc(pool->backing, chunk_size);
+    // Blocks are between the ends of chunk, so they can be pushed to free_list
+    // if both ends fit.
+    if ( ! lf_stack_fits((char*)chunk + chunk_size - 1) || ! lf_stack_push(&pool->chunks, chunk)) {
+        fprintf(stderr, "LFPool chunk at %p does not fit in LFStack.\n", (void*)chunk);
+        abort();
+    }
+
+    char* blocks = (char*)chunk + header_size;
+    for (size_t i = 0; i < pool->chunk_length - 1; ++i)
+        ((LFPoolBlock*)(blocks + i * pool->block_size))->batch = (LFPoolBlock*)(blocks + (i + 1) * pool->block_size);
+    ((LFPoolBlock*)(blocks + (pool->chunk_length - 1) * pool->block_size))->batch = NULL;
+    return (LFPoolBlock*)blocks;
+}
+
+static inline void* lf_pool_allocator_alloc(const GPAllocator* allocator, size_t size)
+{
+    assert(size <= ((const LFPool*)allocator)->block_size);
+    (void)size;
+    return lf_pool_alloc((LFPool*)allocator);
+}
+
+static inline void lf_pool_allocator_dealloc(const GPAllocator* allocator, void* block)
+{
+    if (block != NULL)
+        lf_pool_dealloc((LFPool*)allocator, block);
+}
+
+static inline void* lf_pool_cache_allocator_alloc(const GPAllocator* allocator, size_t size)
+{
+    assert(size <= ((const LFPoolCache*)allocator)->pool->block_size);
+    (void)size;
+    return lf_pool_cache_alloc((LFPoolCache*)allocator);
+}
+
+static inline void lf_pool_cache_allocator_dealloc(const GPAllocator* allocator, void* block)
+{
+    if (block != NULL)
+        lf_pool_cache_dealloc((LFPoolCache*)allocator, block);
+}
+#endif
+
+static inline unsigned lf_msb(uint64_t x)
+{
+    #if __GNUC__
+    return 63 - __builtin_clzll(x);
+    #else
+    unsigned msb = 0;
+    while (x >>= 1)
+        ++msb;
+    return msb;
+    #endif
+}
+
+static inline size_t lf_histogram_index(uint64_t value)
+{
+    if (value < (1u << LF_HISTOGRAM_SUB_BITS))
+        return value;
+    unsigned msb = lf_msb(value);
+    return ((size_t)(msb - LF_HISTOGRAM_SUB_BITS + 1) << LF_HISTOGRAM_SUB_BITS)
+        + ((value >> (msb - LF_HISTOGRAM_SUB_BITS)) & ((1u << LF_HISTOGRAM_SUB_BITS) - 1));
+}
+
+static inline uint64_t lf_histogram_lower_bound(size_t index)
+{
+    size_t group = index >> LF_HISTOGRAM_SUB_BITS;
+    size_t sub   = index & ((1u << LF_HISTOGRAM_SUB_BITS) - 1);
+    if (group == 0)
+        return sub;
+    return (uint64_t)((1u << LF_HISTOGRAM_SUB_BITS) + sub) << (group - 1);
+}
+
+#if LF_LINUX && defined(GP_MEMORY_INCLUDED)
+// Blocks start with their size so they can be unmapped.
+static inline void* lf_huge_allocator_alloc(const GPAllocator* allocator, size_t size)
+{
+    (void)allocator;
+    size_t* block = (size_t*)lf_huge_alloc(64 + size);
+    if (block == NULL) {
+        perror("lf_huge_alloc() failed");
+        abort();
+    }
+    *block = 64 + size;
+    return (char*)block + 64;
+}
+
+static inline void lf_huge_allocator_dealloc(const GPAllocator* allocator, void* block)
+{
+    (void)allocator;
+    if (block != NULL)
+        lf_huge_free((char*)block - 64, *(size_t*)((char*)block - 64));
+}
+#endif
+
+// LFQueue(T) is a plain pointer for all kinds, so kind is only known at run
+// time. kind is on the read-only cache line that is loaded anyway, and SPSC is
+// checked first so it stays a single predicted branch.
+static inline bool lf_queue_enqueue(LFSPSCQueue* queue, const void*LF_RESTRICT data, size_t data_size)
+{
+    if (LF_LIKELY(queue->kind == LF_SPSC))
+        return lf_spsc_enqueue(queue, data, data_size);
+    switch (queue->kind) {
+        case LF_MPSC: return lf_mpsc_enqueue((LFMPSCQueue*)queue, data, data_size);
+        case LF_SPMC: return lf_spmc_enqueue((LFSPMCQueue*)queue, data, data_size);
+        default:      return lf_mpmc_enqueue((LFMPMCQueue*)queue, data, data_size);
+    }
+}
+
+static inline void* lf_queue_dequeue(LFSPSCQueue* queue, void*LF_RESTRICT out, size_t out_size)
+{
+    if (LF_LIKELY(queue->kind == LF_SPSC))
+        return lf_spsc_dequeue(queue, out, out_size);
+    switch (queue->kind) {
+        case LF_MPSC: return lf_mpsc_dequeue((LFMPSCQueue*)queue, out, out_size);
+        case LF_SPMC: return lf_spmc_dequeue((LFSPMCQueue*)queue, out, out_size);
+        default:      return lf_mpmc_dequeue((LFMPMCQueue*)queue, out, out_size);
+    }
+}
+
+// Generic batch and in place operations only exist for SPSC.
+static inline LFSPSCQueue* lf_queue_spsc(void* queue)
+{
+    assert(((LFSPSCQueue*)queue)->kind == LF_SPSC);
+    return (LFSPSCQueue*)queue;
+}
+
+// Copy count elements to ring buffer starting from index splitting the copy in
+// two if it does not fit before the end of the buffer.
+static inline void lf_copy_in(
+    void* buffer, size_t buffer_length, LFUint index, const void*LF_RESTRICT src, size_t elem_size, size_t count)
+{
+    size_t first = buffer_length - index < count ? buffer_length - index : count;
+    memcpy((char*)buffer + elem_size * index, src, elem_size * first);
+    memcpy(buffer, (const char*)src + elem_size * first, elem_size * (count - first));
+}
+
+static inline void lf_copy_out(
+    void*LF_RESTRICT dest, const void* buffer, size_t buffer_length, LFUint index, size_t elem_size, size_t count)
+{
+    size_t first = buffer_length - index < count ? buffer_length - index : count;
+    memcpy(dest, (const char*)buffer + elem_size * index, elem_size * first);
+    memcpy((char*)dest + elem_size * first, buffer, elem_size * (count - first));
+}
+
+#if __STDC_VERSION__ >= 202311L
+#define LF_TYPEOF(...) typeof(__VA_ARGS__)
+#elif __cplusplus
+#define LF_TYPEOF(...) decltype(__VA_ARGS__)
+#else
+#define LF_TYPEOF(...) __typeof__(__VA_ARGS__)
+#endif
+
+#define LF_OVERLOAD2(_0, _1, RESOLVED, ...) RESOLVED
+#define LF_OVERLOAD3(_0, _1, _2, RESOLVED, ...) RESOLVED
+
+#define LF_QUEUE_WOUT_BUFFER(T, BUFFER_LENGTH) \
+    (LFSPSCQueue){.buffer = (T[BUFFER_LENGTH]){0}, .buffer_length = (BUFFER_LENGTH) }
+#define LF_QUEUE_WITH_BUFFER(T, BUFFER, BUFFER_LENGTH) \
+    (LFSPSCQueue){.buffer = (BUFFER), .buffer_length = (BUFFER_LENGTH) }
+
+#define LF_MPSC_QUEUE_WOUT_BUFFER(T, BUFFER_LENGTH) \
+    (LFMPSCQueue){.buffer = (T[BUFFER_LENGTH]){0}, .buffer_length = (BUFFER_LENGTH), .kind = LF_MPSC, \
+        .sequences = (LFAtomic(LFUint)[BUFFER_LENGTH]){0} }
+#define LF_MPSC_QUEUE_WITH_BUFFER(T, BUFFER, SEQUENCES, BUFFER_LENGTH) \
+    (LFMPSCQueue){.buffer = (BUFFER), .buffer_length = (BUFFER_LENGTH), .kind = LF_MPSC, .sequences = (SEQUENCES) }
+#define LF_SPMC_QUEUE_WOUT_BUFFER(T, BUFFER_LENGTH) \
+    (LFSPMCQueue){.buffer = (T[BUFFER_LENGTH]){0}, .buffer_length = (BUFFER_LENGTH), .kind = LF_SPMC, \
+        .sequences = (LFAtomic(LFUint)[BUFFER_LENGTH]){0} }
+#define LF_SPMC_QUEUE_WITH_BUFFER(T, BUFFER, SEQUENCES, BUFFER_LENGTH) \
+    (LFSPMCQueue){.buffer = (BUFFER), .buffer_length = (BUFFER_LENGTH), .kind = LF_SPMC, .sequences = (SEQUENCES) }
+#define LF_MPMC_QUEUE_WOUT_BUFFER(T, BUFFER_LENGTH) \
+    (LFMPMCQueue){.buffer = (T[BUFFER_LENGTH]){0}, .buffer_length = (BUFFER_LENGTH), .kind = LF_MPMC, \
+        .sequences = (LFAtomic(LFUint)[BUFFER_LENGTH]){0} }
+#define LF_MPMC_QUEUE_WITH_BUFFER(T, BUFFER, SEQUENCES, BUFFER_LENGTH) \
+    (LFMPMCQueue){.buffer = (BUFFER), .buffer_length = (BUFFER_LENGTH), .kind = LF_MPMC, .sequences = (SEQUENCES) }
 
 #define LF_DEQUEUE_WOUT_BUFFER(QUEUE) \
-    (LF_TYPEOF(QUEUE))lf_spsc_dequeue((LFSPSCQueue*)(QUEUE), &(LF_TYPEOF(*(QUEUE))){0}, sizeof(*(QUEUE)))
+    (LF_TYPEOF(QUEUE))lf_queue_dequeue((LFSPSCQueue*)(QUEUE), &(LF_TYPEOF(*(QUEUE))){0}, sizeof(*(QUEUE)))
 #define LF_DEQUEUE_WITH_BUFFER(QUEUE, BUFFER) \
-    (LF_TYPEOF(QUEUE))lf_spsc_dequeue((LFSPSCQueue*)(QUEUE), (BUFFER), sizeof(*(QUEUE) = (BUFFER)))
+    (LF_TYPEOF(QUEUE))lf_queue_dequeue((LFSPSCQueue*)(QUEUE), (BUFFER), sizeof(*(BUFFER) = *(QUEUE)))
 
 #endif // LFC_H_INCLUDED
@@ -1,8 +1,11 @@
-#include "lfc.h"
 #include "gpc.h"
+#include "lfc.h"
 #include <pthread.h>
-#include <signal.h>
-#include <x86intrin.h>
+#if LF_POSIX
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
 
 GPArena arena;
 
@@ -58,58 +61,1405 @@ void* produce(void*_)
     return NULL;
 }
 
-// Moving average for benchmark
-double filter(double f)
+void test_batch(void)
+{
+    size_t buf[8];
+    size_t in[8]  = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    size_t out[8] = {0};
+    #if __cplusplus
+    LFSPSCQueue q = {};
+    q.buffer = buf;
+    q.buffer_length = 8;
+    #define ENQUEUE_N(ELEMS, COUNT) lf_spsc_enqueue_n(&q, (ELEMS), sizeof(size_t), (COUNT))
+    #define DEQUEUE_N(OUT, COUNT)   lf_spsc_dequeue_n(&q, (OUT), sizeof(size_t), (COUNT))
+    #else
+    LFQueue(size_t) q = lf_queue(size_t, buf, 8);
+    #define ENQUEUE_N(ELEMS, COUNT) lf_enqueue_n(q, (ELEMS), (COUNT))
+    #define DEQUEUE_N(OUT, COUNT)   lf_dequeue_n(q, (OUT), (COUNT))
+    #endif
+
+    gp_assert(ENQUEUE_N(in, 5) == 5);
+    gp_assert(DEQUEUE_N(out, 3) == 3);
+    gp_assert(out[0] == 1 && out[2] == 3);
+    gp_assert(ENQUEUE_N(in + 5, 3) == 3);
+    gp_assert(ENQUEUE_N(in, 8) == 2, "Only 7 elements fit in queue of 8.");
+    gp_assert(DEQUEUE_N(out, 8) == 7);
+    for (size_t i = 0; i < 5; ++i)
+        gp_assert(out[i] == in[i + 3], i, out[i]);
+    gp_assert(out[5] == 1 && out[6] == 2);
+    gp_assert(DEQUEUE_N(out, 8) == 0);
+    #undef ENQUEUE_N
+    #undef DEQUEUE_N
+}
+
+typedef struct order
+{
+    size_t id;
+    char   payload[504];
+} Order;
+
+void test_in_place(void)
+{
+    Order buf[4];
+    #if __cplusplus
+    LFSPSCQueue q = {};
+    q.buffer = buf;
+    q.buffer_length = 4;
+    #define RESERVE() (Order*)lf_spsc_reserve(&q, sizeof(Order))
+    #define COMMIT()  lf_spsc_commit(&q)
+    #define PEEK()    (Order*)lf_spsc_peek(&q, sizeof(Order))
+    #define RELEASE() lf_spsc_release(&q)
+    #else
+    LFQueue(Order) q = lf_queue(Order, buf, 4);
+    #define RESERVE() lf_reserve(q)
+    #define COMMIT()  lf_commit(q)
+    #define PEEK()    lf_peek(q)
+    #define RELEASE() lf_release(q)
+    #endif
+
+    for (size_t lap = 0; lap < 3; ++lap)
+    {
+        gp_assert(PEEK() == NULL);
+        for (size_t i = 0; i < 3; ++i) {
+            Order* order = RESERVE();
+            gp_assert(order != NULL && order >= buf && order < buf + 4);
+            order->id = i;
+            order->payload[sizeof order->payload - 1] = (char)i;
+            COMMIT();
+        }
+        gp_assert(RESERVE() == NULL);
+        for (size_t i = 0; i < 3; ++i) {
+            Order* order = PEEK();
+            gp_assert(order != NULL);
+            gp_assert(order->id == i && order->payload[sizeof order->payload - 1] == (char)i);
+            RELEASE();
+        }
+    }
+    #undef RESERVE
+    #undef COMMIT
+    #undef PEEK
+    #undef RELEASE
+}
+
+void test_ring(void)
+{
+    alignas(LF_RING_ALIGNMENT) char buf[256];
+    #if __cplusplus
+    LFSPSCRing ring = {};
+    #else
+    LFSPSCRing ring = {0};
+    #endif
+    ring.buffer = buf;
+    ring.buffer_size = sizeof buf;
+
+    const char* messages[] = { "short", "a bit longer message", "", "x", "the longest message of them all" };
+    const size_t messages_length = sizeof messages / sizeof messages[0];
+    size_t pushed = 0;
+    size_t popped = 0;
+    size_t size;
+
+    gp_assert(lf_spsc_ring_reserve(&ring, sizeof buf / 2) == NULL, "Should never fit.");
+    gp_assert(lf_spsc_ring_peek(&ring, &size) == NULL);
+    while (popped < 100)
+    {
+        while (lf_spsc_ring_push(&ring, messages[pushed % messages_length], strlen(messages[pushed % messages_length])))
+            ++pushed;
+        gp_assert(pushed - popped >= 4, "Ring should not be that small.", pushed - popped);
+
+        for (size_t i = 0; i < 3; ++i) {
+            const char* record = (const char*)lf_spsc_ring_peek(&ring, &size);
+            gp_assert(record != NULL);
+            gp_assert((uintptr_t)record % LF_RING_ALIGNMENT == 0);
+            gp_assert(size == strlen(messages[popped % messages_length]), size, popped);
+            gp_assert(memcmp(record, messages[popped % messages_length], size) == 0);
+            lf_spsc_ring_release(&ring);
+            ++popped;
+        }
+    }
+}
+
+#define MPSC_PRODUCERS 4
+#define MPSC_LENGTH    (1 << 16)
+
+#if __cplusplus
+LFAtomic(LFUint) mpsc_sequences[QUEUE_BUF_SIZE] = {};
+LFMPSCQueue mpsc_queue = {};
+#else
+LFQueue(uint64_t) mpsc_queue = lf_mpsc_queue(uint64_t, QUEUE_BUF_SIZE);
+#endif
+
+void* mpsc_produce(void* id)
+{
+    for (uint64_t i = 0; i < MPSC_LENGTH; ++i) {
+        #if __cplusplus
+        uint64_t elem = (uint64_t)(uintptr_t)id << 32 | i;
+        while ( ! lf_mpsc_enqueue(&mpsc_queue, &elem, sizeof elem));
+        #else
+        while ( ! lf_enqueue(mpsc_queue, (uint64_t)(uintptr_t)id << 32 | i));
+        #endif
+    }
+    return NULL;
+}
+
+void test_mpsc(void)
+{
+    #if __cplusplus
+    mpsc_queue.buffer        = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(uint64_t));
+    mpsc_queue.buffer_length = QUEUE_BUF_SIZE;
+    mpsc_queue.kind          = LF_MPSC;
+    mpsc_queue.sequences     = mpsc_sequences;
+    #endif
+    pthread_t producers[MPSC_PRODUCERS];
+    for (uintptr_t i = 0; i < MPSC_PRODUCERS; ++i)
+        pthread_create(&producers[i], NULL, mpsc_produce, (void*)i);
+
+    uint64_t expected[MPSC_PRODUCERS] = {0};
+    for (size_t i = 0; i < MPSC_PRODUCERS * MPSC_LENGTH; ++i)
+    {
+        uint64_t  elem_mem;
+        uint64_t* elem;
+        #if __cplusplus
+        while ((elem = (uint64_t*)lf_mpsc_dequeue(&mpsc_queue, &elem_mem, sizeof elem_mem)) == NULL);
+        #else
+        while ((elem = lf_dequeue(mpsc_queue, &elem_mem)) == NULL);
+        #endif
+        uint64_t id = *elem >> 32;
+        gp_assert(id < MPSC_PRODUCERS, id);
+        gp_assert((*elem & 0xFFFFFFFF) == expected[id], "Out of order.", *elem, expected[id]);
+        ++expected[id];
+    }
+    for (size_t i = 0; i < MPSC_PRODUCERS; ++i)
+        pthread_join(producers[i], NULL);
+    uint64_t elem_mem;
+    #if __cplusplus
+    gp_assert(lf_mpsc_dequeue(&mpsc_queue, &elem_mem, sizeof elem_mem) == NULL);
+    #else
+    gp_assert(lf_dequeue(mpsc_queue, &elem_mem) == NULL);
+    #endif
+
+    // Full queue should refuse instead of waiting for the consumer.
+    #if __cplusplus
+    LFMPSCQueue* full_queue = &mpsc_queue;
+    #else
+    LFMPSCQueue* full_queue = (LFMPSCQueue*)mpsc_queue;
+    #endif
+    for (uint64_t i = 0; i < QUEUE_BUF_SIZE; ++i)
+        gp_assert(lf_mpsc_enqueue(full_queue, &i, sizeof i));
+    gp_assert( ! lf_mpsc_enqueue(full_queue, &elem_mem, sizeof elem_mem), "Full queue should not block.");
+    for (uint64_t i = 0; i < QUEUE_BUF_SIZE; ++i)
+        gp_assert(lf_mpsc_dequeue(full_queue, &elem_mem, sizeof elem_mem) != NULL && elem_mem == i);
+}
+
+#define SPMC_CONSUMERS 4
+#define SPMC_LENGTH    (1 << 18)
+
+#if __cplusplus
+LFAtomic(LFUint) spmc_sequences[QUEUE_BUF_SIZE] = {};
+LFSPMCQueue spmc_queue = {};
+#else
+LFQueue(size_t) spmc_queue = lf_spmc_queue(size_t, QUEUE_BUF_SIZE);
+#endif
+LFAtomic(size_t) spmc_consumed;
+unsigned char spmc_seen[SPMC_LENGTH];
+
+void* spmc_consume(void*_)
+{
+    (void)_;
+    LF_USING_NAMESPACE_STD;
+    size_t last = 0;
+    while (atomic_load(&spmc_consumed) < SPMC_LENGTH)
+    {
+        size_t  elem_mem;
+        size_t* elem;
+        #if __cplusplus
+        elem = (size_t*)lf_spmc_dequeue(&spmc_queue, &elem_mem, sizeof elem_mem);
+        #else
+        elem = lf_dequeue(spmc_queue, &elem_mem);
+        #endif
+        if (elem == NULL)
+            continue;
+        gp_assert(*elem > last, "Consumer should see elements in order.", *elem, last);
+        last = *elem;
+        ++spmc_seen[*elem - 1];
+        atomic_fetch_add(&spmc_consumed, 1);
+    }
+    return NULL;
+}
+
+void test_spmc(void)
+{
+    #if __cplusplus
+    spmc_queue.buffer        = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(size_t));
+    spmc_queue.buffer_length = QUEUE_BUF_SIZE;
+    spmc_queue.kind          = LF_SPMC;
+    spmc_queue.sequences     = spmc_sequences;
+    #endif
+    pthread_t consumers[SPMC_CONSUMERS];
+    for (size_t i = 0; i < SPMC_CONSUMERS; ++i)
+        pthread_create(&consumers[i], NULL, spmc_consume, NULL);
+
+    for (size_t i = 1; i <= SPMC_LENGTH; ++i) {
+        #if __cplusplus
+        while ( ! lf_spmc_enqueue(&spmc_queue, &i, sizeof i));
+        #else
+        while ( ! lf_enqueue(spmc_queue, i));
+        #endif
+    }
+    for (size_t i = 0; i < SPMC_CONSUMERS; ++i)
+        pthread_join(consumers[i], NULL);
+    for (size_t i = 0; i < SPMC_LENGTH; ++i)
+        gp_assert(spmc_seen[i] == 1, "Every element should be consumed once.", i, spmc_seen[i]);
+
+    size_t untouched = SIZE_MAX;
+    #if __cplusplus
+    gp_assert(lf_spmc_dequeue(&spmc_queue, &untouched, sizeof untouched) == NULL);
+    #else
+    gp_assert(lf_dequeue(spmc_queue, &untouched) == NULL);
+    #endif
+    gp_assert(untouched == SIZE_MAX, "Failed dequeue should not write to out.");
+}
+
+#define MPMC_THREADS 4
+#define MPMC_LENGTH  (1 << 16)
+
+#if __cplusplus
+LFAtomic(LFUint) mpmc_sequences[QUEUE_BUF_SIZE] = {};
+LFMPMCQueue mpmc_queue = {};
+#else
+LFQueue(uint64_t) mpmc_queue = lf_mpmc_queue(uint64_t, QUEUE_BUF_SIZE);
+#endif
+LFAtomic(size_t) mpmc_consumed;
+unsigned char mpmc_seen[MPMC_THREADS][MPMC_LENGTH];
+
+void* mpmc_produce(void* id)
+{
+    for (uint64_t i = 0; i < MPMC_LENGTH; ++i) {
+        uint64_t elem = (uint64_t)(uintptr_t)id << 32 | i;
+        #if __cplusplus
+        while ( ! lf_mpmc_enqueue(&mpmc_queue, &elem, sizeof elem));
+        #else
+        while ( ! lf_enqueue(mpmc_queue, elem));
+        #endif
+    }
+    return NULL;
+}
+
+void* mpmc_consume(void*_)
+{
+    (void)_;
+    LF_USING_NAMESPACE_STD;
+    uint64_t next[MPMC_THREADS] = {0};
+    while (atomic_load(&mpmc_consumed) < MPMC_THREADS * MPMC_LENGTH)
+    {
+        uint64_t  elem_mem;
+        uint64_t* elem;
+        #if __cplusplus
+        elem = (uint64_t*)lf_mpmc_dequeue(&mpmc_queue, &elem_mem, sizeof elem_mem);
+        #else
+        elem = lf_dequeue(mpmc_queue, &elem_mem);
+        #endif
+        if (elem == NULL)
+            continue;
+        uint64_t id = *elem >> 32;
+        uint64_t i  = *elem & 0xFFFFFFFF;
+        gp_assert(id < MPMC_THREADS && i >= next[id], "Consumer should see producers elements in order.", id, i);
+        next[id] = i + 1;
+        ++mpmc_seen[id][i];
+        atomic_fetch_add(&mpmc_consumed, 1);
+    }
+    return NULL;
+}
+
+void test_mpmc(void)
+{
+    #if __cplusplus
+    mpmc_queue.buffer        = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(uint64_t));
+    mpmc_queue.buffer_length = QUEUE_BUF_SIZE;
+    mpmc_queue.kind          = LF_MPMC;
+    mpmc_queue.sequences     = mpmc_sequences;
+    #endif
+    pthread_t producers[MPMC_THREADS];
+    pthread_t consumers[MPMC_THREADS];
+    for (uintptr_t i = 0; i < MPMC_THREADS; ++i) {
+        pthread_create(&producers[i], NULL, mpmc_produce, (void*)i);
+        pthread_create(&consumers[i], NULL, mpmc_consume, NULL);
+    }
+    for (size_t i = 0; i < MPMC_THREADS; ++i) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    for (size_t i = 0; i < MPMC_THREADS; ++i)
+        for (size_t j = 0; j < MPMC_LENGTH; ++j)
+            gp_assert(mpmc_seen[i][j] == 1, "Every element should be consumed once.", i, j);
+}
+
+#define SEGMENT_LENGTH 64
+
+LFSegmentedQueue segmented_queue;
+
+void* segmented_produce(void*_)
+{
+    (void)_;
+    for (size_t i = 1; i <= DATA_LENGTH; ++i)
+        lf_segmented_enqueue(&segmented_queue, &i);
+    return NULL;
+}
+
+void test_segmented(void)
+{
+    GPArena segments = gp_arena_new(0);
+    lf_segmented_init(&segmented_queue, (GPAllocator*)&segments, sizeof(size_t), SEGMENT_LENGTH);
+
+    size_t out;
+    gp_assert(lf_segmented_dequeue(&segmented_queue, &out) == NULL);
+    for (size_t i = 0; i < 10 * SEGMENT_LENGTH; ++i)
+        lf_segmented_enqueue(&segmented_queue, &i);
+    for (size_t i = 0; i < 10 * SEGMENT_LENGTH; ++i) {
+        gp_assert(lf_segmented_dequeue(&segmented_queue, &out) != NULL);
+        gp_assert(out == i, out, i);
+    }
+    gp_assert(lf_segmented_dequeue(&segmented_queue, &out) == NULL);
+    lf_segmented_destroy(&segmented_queue);
+
+    lf_segmented_init(&segmented_queue, gp_heap, sizeof(size_t), SEGMENT_LENGTH);
+    pthread_t producer;
+    pthread_create(&producer, NULL, segmented_produce, NULL);
+    for (size_t i = 1; i <= DATA_LENGTH; ++i) {
+        while (lf_segmented_dequeue(&segmented_queue, &out) == NULL);
+        gp_assert(out == i, out, i);
+    }
+    pthread_join(producer, NULL);
+    lf_segmented_destroy(&segmented_queue);
+    gp_arena_delete(&segments);
+}
+
+#if __cplusplus
+LFSPSCQueue waiting_queue = {};
+#else
+LFSPSCQueue waiting_queue = {0};
+#endif
+
+void* waiting_produce(void*_)
+{
+    (void)_;
+    for (size_t i = 1; i <= DATA_LENGTH / 8; ++i)
+        lf_spsc_enqueue_wait(&waiting_queue, &i, sizeof i);
+    return NULL;
+}
+
+void test_waiting(void)
+{
+    waiting_queue.buffer        = gp_alloc(&arena, 16 * sizeof(size_t));
+    waiting_queue.buffer_length = 16;
+    pthread_t producer;
+    pthread_create(&producer, NULL, waiting_produce, NULL);
+    for (size_t i = 1; i <= DATA_LENGTH / 8; ++i) {
+        size_t out;
+        gp_assert(lf_spsc_dequeue_wait(&waiting_queue, &out, sizeof out) == &out);
+        gp_assert(out == i, out, i);
+    }
+    pthread_join(producer, NULL);
+}
+
+LFHistogram histogram;
+
+void test_histogram(void)
+{
+    gp_assert(lf_histogram_percentile(&histogram, 50) == 0);
+    for (uint64_t i = 1; i <= 1000; ++i)
+        lf_histogram_record(&histogram, i);
+    uint64_t p50  = lf_histogram_percentile(&histogram, 50);
+    uint64_t p100 = lf_histogram_percentile(&histogram, 100);
+    gp_assert(p50  >= 500  && p50  <= 500  + 500  / 16, p50);
+    gp_assert(p100 >= 1000 && p100 <= 1000 + 1000 / 16, p100);
+    gp_assert(lf_histogram_percentile(&histogram, 0) == 1);
+
+    #ifdef LF_LATENCY
+    memset((void*)&histogram, 0, sizeof histogram);
+    size_t   buf[8];
+    uint64_t timestamps[8];
+    #if __cplusplus
+    LFSPSCQueue q = {};
+    #else
+    LFSPSCQueue q = {0};
+    #endif
+    q.buffer        = buf;
+    q.buffer_length = 8;
+    q.timestamps    = timestamps;
+    q.latency       = &histogram;
+    for (size_t i = 0; i < 5; ++i) {
+        size_t out;
+        gp_assert(lf_spsc_enqueue(&q, &i, sizeof i));
+        gp_assert(lf_spsc_dequeue(&q, &out, sizeof out));
+    }
+    gp_assert(lf_spsc_enqueue_n(&q, buf, sizeof buf[0], 3) == 3);
+    gp_assert(lf_spsc_dequeue_n(&q, buf, sizeof buf[0], 3) == 3);
+    uint64_t recorded = 0;
+    for (size_t i = 0; i < LF_HISTOGRAM_LENGTH; ++i)
+        recorded += histogram.counts[i];
+    gp_assert(recorded == 8, recorded);
+    #endif
+}
+
+#define BROADCAST_CONSUMERS 3
+#define BROADCAST_LENGTH    (1 << 16)
+
+LFCursor broadcast_cursors[BROADCAST_CONSUMERS];
+LFBroadcastRing broadcast_ring;
+
+void* broadcast_consume(void* cursor)
+{
+    for (uint64_t i = 0; i < BROADCAST_LENGTH; ++i) {
+        uint64_t out;
+        while (lf_broadcast_receive(&broadcast_ring, (LFCursor*)cursor, &out, sizeof out) == NULL);
+        gp_assert(out == i, out, i);
+    }
+    return NULL;
+}
+
+#define BROADCAST_CHURN 100
+
+LFAtomic(size_t) broadcast_joined;
+LFAtomic(bool) broadcast_done;
+
+void* broadcast_churn(void*_)
+{
+    (void)_;
+    while ( ! atomic_load(&broadcast_done)) {
+        LFCursor* cursor = lf_broadcast_register(&broadcast_ring);
+        if (cursor == NULL)
+            continue;
+        uint64_t last, out;
+        while (lf_broadcast_receive(&broadcast_ring, cursor, &last, sizeof last) == NULL)
+            if (atomic_load(&broadcast_done))
+                goto done;
+        for (size_t i = 0; i < 2 * QUEUE_BUF_SIZE; ++i) {
+            while (lf_broadcast_receive(&broadcast_ring, cursor, &out, sizeof out) == NULL)
+                if (atomic_load(&broadcast_done))
+                    goto done;
+            gp_assert(out == last + 1, "Element got overwritten before received.", out, last);
+            last = out;
+        }
+        done:
+        lf_broadcast_unregister(&broadcast_ring, cursor);
+        atomic_fetch_add(&broadcast_joined, 1);
+    }
+    return NULL;
+}
+
+void test_broadcast(void)
+{
+    broadcast_ring.buffer         = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(uint64_t));
+    broadcast_ring.buffer_length  = QUEUE_BUF_SIZE;
+    broadcast_ring.cursors        = broadcast_cursors;
+    broadcast_ring.cursors_length = BROADCAST_CONSUMERS;
+
+    pthread_t consumers[BROADCAST_CONSUMERS];
+    for (size_t i = 0; i < BROADCAST_CONSUMERS; ++i)
+        pthread_create(&consumers[i], NULL, broadcast_consume, &broadcast_cursors[i]);
+    for (uint64_t i = 0; i < BROADCAST_LENGTH; ++i)
+        while ( ! lf_broadcast_publish(&broadcast_ring, &i, sizeof i));
+    for (size_t i = 0; i < BROADCAST_CONSUMERS; ++i)
+        pthread_join(consumers[i], NULL);
+
+    // Slowest consumer holds the producer back.
+    LFCursor* slow = &broadcast_cursors[0];
+    for (uint64_t i = 0; i < QUEUE_BUF_SIZE; ++i) {
+        uint64_t out;
+        gp_assert(lf_broadcast_publish(&broadcast_ring, &i, sizeof i));
+        for (size_t j = 1; j < BROADCAST_CONSUMERS; ++j)
+            gp_assert(lf_broadcast_receive(&broadcast_ring, &broadcast_cursors[j], &out, sizeof out));
+    }
+    uint64_t elem = 0;
+    gp_assert( ! lf_broadcast_publish(&broadcast_ring, &elem, sizeof elem));
+    const uint64_t* first = (const uint64_t*)lf_broadcast_peek(&broadcast_ring, slow, sizeof*first);
+    gp_assert(first != NULL && *first == 0);
+    lf_broadcast_release(&broadcast_ring, slow);
+    gp_assert(lf_broadcast_publish(&broadcast_ring, &elem, sizeof elem));
+
+    // Detached consumers do not hold the producer back.
+    lf_broadcast_unregister(&broadcast_ring, slow);
+    for (size_t j = 1; j < BROADCAST_CONSUMERS; ++j)
+        lf_broadcast_unregister(&broadcast_ring, &broadcast_cursors[j]);
+    for (uint64_t i = 0; i < 2 * QUEUE_BUF_SIZE; ++i)
+        gp_assert(lf_broadcast_publish(&broadcast_ring, &i, sizeof i));
+
+    // Consumers joining and leaving while producer publishes see consecutive
+    // elements from the time they joined.
+    atomic_store(&broadcast_done, false);
+    pthread_t churners[BROADCAST_CONSUMERS];
+    for (size_t i = 0; i < BROADCAST_CONSUMERS; ++i)
+        pthread_create(&churners[i], NULL, broadcast_churn, NULL);
+    for (uint64_t i = 0; atomic_load(&broadcast_joined) < BROADCAST_CONSUMERS * BROADCAST_CHURN;)
+        i += lf_broadcast_publish(&broadcast_ring, &i, sizeof i);
+    atomic_store(&broadcast_done, true);
+    for (size_t i = 0; i < BROADCAST_CONSUMERS; ++i)
+        pthread_join(churners[i], NULL);
+    gp_assert(lf_broadcast_register(&broadcast_ring) != NULL);
+}
+
+#define PIPELINE_STAGES 3
+#define PIPELINE_LENGTH (1 << 16)
+
+typedef struct message
+{
+    uint64_t raw;
+    uint64_t decoded;
+    uint64_t enriched;
+} Message;
+
+LFCursor pipeline_stages[PIPELINE_STAGES];
+LFPipeline pipeline;
+LFAtomic(uint64_t) pipeline_persisted;
+
+void* pipeline_stage(void* _stage)
+{
+    size_t stage = (size_t)_stage;
+    for (uint64_t i = 0; i < PIPELINE_LENGTH; ++i) {
+        Message* message;
+        while ((message = (Message*)lf_pipeline_peek(&pipeline, stage, sizeof*message)) == NULL);
+        gp_assert(message->raw == i, message->raw, i);
+        if (stage == 0) {
+            message->decoded = message->raw * 2;
+        } else if (stage == 1) {
+            gp_assert(message->decoded == 2 * i);
+            message->enriched = message->decoded + 1;
+        } else {
+            gp_assert(message->enriched == 2 * i + 1);
+            atomic_fetch_add(&pipeline_persisted, 1);
+        }
+        lf_pipeline_release(&pipeline, stage);
+    }
+    return NULL;
+}
+
+void test_pipeline(void)
+{
+    pipeline.buffer        = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(Message));
+    pipeline.buffer_length = QUEUE_BUF_SIZE;
+    pipeline.stages        = pipeline_stages;
+    pipeline.stages_length = PIPELINE_STAGES;
+
+    pthread_t stages[PIPELINE_STAGES];
+    for (size_t i = 0; i < PIPELINE_STAGES; ++i)
+        pthread_create(&stages[i], NULL, pipeline_stage, (void*)i);
+    for (uint64_t i = 0; i < PIPELINE_LENGTH; ++i) {
+        Message* message;
+        while ((message = (Message*)lf_pipeline_reserve(&pipeline, sizeof*message)) == NULL);
+        message->raw = i;
+        lf_pipeline_commit(&pipeline);
+    }
+    for (size_t i = 0; i < PIPELINE_STAGES; ++i)
+        pthread_join(stages[i], NULL);
+    gp_assert(atomic_load(&pipeline_persisted) == PIPELINE_LENGTH);
+    gp_assert(lf_pipeline_peek(&pipeline, 0, sizeof(Message)) == NULL);
+}
+
+#ifdef LF_STATS
+void test_stats(void)
+{
+    size_t buf[8];
+    size_t elems[8] = {0};
+    #if __cplusplus
+    LFSPSCQueue q = {};
+    #else
+    LFSPSCQueue q = {0};
+    #endif
+    q.buffer = buf;
+    q.buffer_length = 8;
+
+    size_t out;
+    gp_assert(lf_spsc_dequeue(&q, &out, sizeof out) == NULL);
+    gp_assert(lf_spsc_enqueue_n(&q, elems, sizeof elems[0], 5) == 5);
+    gp_assert(lf_spsc_enqueue(&q, &elems[0], sizeof elems[0]));
+    *(size_t*)lf_spsc_reserve(&q, sizeof elems[0]) = 0;
+    lf_spsc_commit(&q);
+    gp_assert( ! lf_spsc_enqueue(&q, &elems[0], sizeof elems[0]));
+    gp_assert(lf_spsc_dequeue_n(&q, elems, sizeof elems[0], 8) == 7);
+    gp_assert(lf_spsc_dequeue_n(&q, elems, sizeof elems[0], 8) == 0);
+
+    LFQueueStats stats = lf_spsc_stats(&q);
+    gp_assert(stats.enqueued       == 7, stats.enqueued);
+    gp_assert(stats.full           == 1, stats.full);
+    gp_assert(stats.bytes_enqueued == 7 * sizeof(size_t), stats.bytes_enqueued);
+    gp_assert(stats.max_occupancy  == 7, stats.max_occupancy);
+    gp_assert(stats.dequeued       == 7, stats.dequeued);
+    gp_assert(stats.empty          == 2, stats.empty);
+    gp_assert(stats.bytes_dequeued == 7 * sizeof(size_t), stats.bytes_dequeued);
+}
+#endif
+
+LF_DEFINE_QUEUE(OrderQueue, Order, 4);
+LF_DEFINE_QUEUE(SizeQueue, size_t, QUEUE_BUF_SIZE);
+
+SizeQueue typed_queue;
+
+void* typed_produce(void*_)
+{
+    (void)_;
+    for (size_t i = 1; i <= DATA_LENGTH; ++i)
+        while ( ! SizeQueue_enqueue(&typed_queue, i));
+    return NULL;
+}
+
+void test_typed_queue(void)
+{
+    static OrderQueue orders;
+    #if __cplusplus
+    Order order = {};
+    #else
+    Order order = {0};
+    #endif
+    for (size_t i = 0; i < 4; ++i) {
+        order.id = i;
+        gp_assert(OrderQueue_enqueue(&orders, order));
+    }
+    gp_assert( ! OrderQueue_enqueue(&orders, order), "Queue should hold exactly 4 elements.");
+    for (size_t i = 0; i < 4; ++i)
+        gp_assert(OrderQueue_dequeue(&orders, &order) && order.id == i);
+    gp_assert( ! OrderQueue_dequeue(&orders, &order));
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, typed_produce, NULL);
+    for (size_t i = 1; i <= DATA_LENGTH; ++i) {
+        size_t out;
+        while ( ! SizeQueue_dequeue(&typed_queue, &out));
+        gp_assert(out == i, out, i);
+    }
+    pthread_join(producer, NULL);
+}
+
+#define DEQUE_THIEVES 3
+#define DEQUE_LENGTH  (1 << 16)
+
+LFDeque deque;
+LFAtomic(bool) deque_done;
+LFAtomic(uint8_t) deque_taken[DEQUE_LENGTH + 1];
+
+void deque_take(void* item)
+{
+    gp_assert(item != NULL);
+    gp_assert(atomic_fetch_add(&deque_taken[(uintptr_t)item], 1) == 0, "Item taken twice.", (uintptr_t)item);
+}
+
+void* deque_steal(void*_)
+{
+    (void)_;
+    while ( ! atomic_load(&deque_done)) {
+        void* item = lf_deque_steal(&deque);
+        if (item != NULL)
+            deque_take(item);
+    }
+    return NULL;
+}
+
+void test_deque(void)
 {
-    #define FLT_WINDOW (1 << 8)
-    static double arr[FLT_WINDOW] = {0};
-    static size_t i   = 0 ;
-    static double sum = 0.;
+    lf_deque_init(&deque, gp_heap, 16);
+    gp_assert(lf_deque_pop(&deque) == NULL);
+    gp_assert(lf_deque_steal(&deque) == NULL);
+    for (uintptr_t i = 1; i <= 100; ++i) // grows
+        lf_deque_push(&deque, (void*)i);
+    gp_assert(lf_deque_steal(&deque) == (void*)1);
+    gp_assert(lf_deque_pop(&deque) == (void*)100);
+    while (lf_deque_pop(&deque) != NULL);
 
-    sum += f;
-    sum -= arr[i];
-    arr[i] = f;
-    i = (i + 1) & (FLT_WINDOW - 1);
+    pthread_t thieves[DEQUE_THIEVES];
+    for (size_t i = 0; i < DEQUE_THIEVES; ++i)
+        pthread_create(&thieves[i], NULL, deque_steal, NULL);
+    for (uintptr_t i = 1; i <= DEQUE_LENGTH; ++i) {
+        lf_deque_push(&deque, (void*)i);
+        if (i % 3 == 0) {
+            void* item = lf_deque_pop(&deque);
+            if (item != NULL)
+                deque_take(item);
+        }
+    }
+    for (void* item; (item = lf_deque_pop(&deque)) != NULL;)
+        deque_take(item);
+    atomic_store(&deque_done, true);
+    for (size_t i = 0; i < DEQUE_THIEVES; ++i)
+        pthread_join(thieves[i], NULL);
 
-    return sum / FLT_WINDOW;
+    for (size_t i = 1; i <= DEQUE_LENGTH; ++i)
+        gp_assert(atomic_load(&deque_taken[i]) == 1, i);
+    lf_deque_destroy(&deque);
 }
 
-// Signal handler
-bool done = false;
-void be_done(int _)
+#define STACK_THREADS 4
+#define STACK_NODES   64
+#define STACK_LENGTH  (1 << 16)
+
+typedef struct stack_item
+{
+    LFStackNode node;
+    size_t      id;
+} StackItem;
+
+LFStack stack;
+StackItem stack_items[STACK_NODES];
+
+void* stack_churn(void*_)
 {
     (void)_;
-    done = true;
+    for (size_t i = 0; i < STACK_LENGTH; ++i) {
+        LFStackNode* node;
+        while ((node = lf_stack_pop(&stack)) == NULL);
+        lf_stack_push(&stack, node);
+    }
+    return NULL;
+}
+
+void test_stack(void)
+{
+    gp_assert(lf_stack_pop(&stack) == NULL);
+    for (size_t i = 0; i < STACK_NODES; ++i) {
+        stack_items[i].id = i;
+        gp_assert(lf_stack_push(&stack, &stack_items[i].node));
+    }
+    gp_assert(((StackItem*)lf_stack_pop(&stack))->id == STACK_NODES - 1);
+    gp_assert(((StackItem*)lf_stack_pop(&stack))->id == STACK_NODES - 2);
+    atomic_store(&stack_items[STACK_NODES - 1].node.next, &stack_items[STACK_NODES - 2].node);
+    gp_assert(lf_stack_push_list(&stack, &stack_items[STACK_NODES - 1].node, &stack_items[STACK_NODES - 2].node));
+
+    pthread_t threads[STACK_THREADS];
+    for (size_t i = 0; i < STACK_THREADS; ++i)
+        pthread_create(&threads[i], NULL, stack_churn, NULL);
+    for (size_t i = 0; i < STACK_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    bool seen[STACK_NODES] = {0};
+    size_t count = 0;
+    for (LFStackNode* node = lf_stack_pop_all(&stack); node != NULL; node = atomic_load(&node->next)) {
+        size_t id = ((StackItem*)node)->id;
+        gp_assert( ! seen[id], "Node in stack twice.", id);
+        seen[id] = true;
+        ++count;
+    }
+    gp_assert(count == STACK_NODES, count);
+    gp_assert(lf_stack_pop(&stack) == NULL);
+
+    #if ! LF_STACK_DOUBLE_WIDTH && UINTPTR_MAX > 0xFFFFFFFF
+    // Tagged pointers do not fit in packed head.
+    LFStackNode* tagged = (LFStackNode*)((uintptr_t)&stack_items[0].node | (uintptr_t)0xAB << 56);
+    gp_assert( ! lf_stack_push(&stack, tagged));
+    atomic_store(&stack_items[1].node.next, tagged);
+    gp_assert( ! lf_stack_push_list(&stack, &stack_items[1].node, tagged));
+    gp_assert(lf_stack_pop(&stack) == NULL, "Failed push should not modify stack.");
+    #endif
+}
+
+#define HAZARD_READERS 3
+#define HAZARD_LENGTH  (1 << 16)
+#define HAZARD_ALIVE   0x600DF00D
+
+typedef struct hazard_object
+{
+    size_t magic;
+    size_t value;
+} HazardObject;
+
+// Counts blocks in use and poisons memory on dealloc to catch use after free.
+typedef struct counting_allocator
+{
+    GPAllocator allocator;
+    LFAtomic(size_t) allocations;
+} CountingAllocator;
+
+#if __cplusplus
+#define COUNTING_ALLOCATOR { { counting_alloc, counting_dealloc }, {} }
+#else
+#define COUNTING_ALLOCATOR { .allocator = { counting_alloc, counting_dealloc } }
+#endif
+
+void* counting_alloc(const GPAllocator* allocator, size_t size)
+{
+    atomic_fetch_add(&((CountingAllocator*)allocator)->allocations, 1);
+    return gp_mem_alloc(gp_heap, size);
 }
 
+void counting_dealloc(const GPAllocator* allocator, void* block)
+{
+    if (block == NULL)
+        return;
+    atomic_fetch_sub(&((CountingAllocator*)allocator)->allocations, 1);
+    memset(block, 0, sizeof(size_t));
+    gp_mem_dealloc(gp_heap, block);
+}
+
+CountingAllocator hazard_allocator = COUNTING_ALLOCATOR;
+LFHazardDomain hazard_domain;
+LFAtomic(void*) hazard_shared;
+LFAtomic(bool) hazard_done;
+
+void* hazard_read(void*_)
+{
+    (void)_;
+    LFHazardRecord* record = lf_hazard_acquire(&hazard_domain);
+    size_t last_value = 0;
+    while ( ! atomic_load(&hazard_done)) {
+        HazardObject* object = (HazardObject*)lf_hazard_protect(record, 0, &hazard_shared);
+        gp_assert(object->magic == HAZARD_ALIVE, "Protected object got deallocated.");
+        gp_assert(object->value >= last_value);
+        last_value = object->value;
+        lf_hazard_clear(record, 0);
+    }
+    lf_hazard_release(record);
+    return NULL;
+}
+
+HazardObject* hazard_new(size_t value)
+{
+    HazardObject* object = (HazardObject*)gp_mem_alloc(&hazard_allocator.allocator, sizeof*object);
+    object->magic = HAZARD_ALIVE;
+    object->value = value;
+    return object;
+}
+
+void test_hazard(void)
+{
+    lf_hazard_init(&hazard_domain, &hazard_allocator.allocator);
+    atomic_store(&hazard_shared, (void*)hazard_new(0));
+
+    pthread_t readers[HAZARD_READERS];
+    for (size_t i = 0; i < HAZARD_READERS; ++i)
+        pthread_create(&readers[i], NULL, hazard_read, NULL);
+
+    LFHazardRecord* record = lf_hazard_acquire(&hazard_domain);
+    gp_assert((uintptr_t)record % 64 == 0, "Records must be cache line aligned.");
+    for (size_t i = 1; i <= HAZARD_LENGTH; ++i)
+        lf_hazard_retire(&hazard_domain, record, atomic_exchange(&hazard_shared, (void*)hazard_new(i)));
+    gp_assert(record->retired_length < HAZARD_LENGTH, "Retired nodes should get reclaimed while running.");
+    lf_hazard_release(record);
+
+    atomic_store(&hazard_done, true);
+    for (size_t i = 0; i < HAZARD_READERS; ++i)
+        pthread_join(readers[i], NULL);
+
+    gp_mem_dealloc(&hazard_allocator.allocator, atomic_load(&hazard_shared));
+    lf_hazard_destroy(&hazard_domain);
+    gp_assert(atomic_load(&hazard_allocator.allocations) == 0, atomic_load(&hazard_allocator.allocations));
+}
+
+// Records and retired lists do not come from the domain allocator, so nodes can
+// be reclaimed to an LFPool with blocks smaller than records.
+void test_hazard_pool(void)
+{
+    CountingAllocator backing = COUNTING_ALLOCATOR;
+    LFPool node_pool;
+    lf_pool_init(&node_pool, &backing.allocator, sizeof(HazardObject), 64);
+    LFHazardDomain domain;
+    lf_hazard_init(&domain, (const GPAllocator*)&node_pool);
+
+    LFAtomic(void*) shared;
+    HazardObject* first = (HazardObject*)lf_pool_alloc(&node_pool);
+    first->magic = HAZARD_ALIVE;
+    atomic_store(&shared, (void*)first);
+    LFHazardRecord* reader = lf_hazard_acquire(&domain);
+    gp_assert(lf_hazard_protect(reader, 0, &shared) == first);
+
+    LFHazardRecord* writer = lf_hazard_acquire(&domain);
+    for (size_t i = 1; i <= 1000; ++i) {
+        HazardObject* object = (HazardObject*)lf_pool_alloc(&node_pool);
+        object->magic = HAZARD_ALIVE;
+        object->value = i;
+        lf_hazard_retire(&domain, writer, atomic_exchange(&shared, (void*)object));
+    }
+    gp_assert(first->magic == HAZARD_ALIVE, "Protected node got reclaimed.");
+    gp_assert(writer->retired_length < 1000, "Retired nodes should get reclaimed to the pool.");
+    lf_hazard_clear(reader, 0);
+    lf_hazard_release(reader);
+    lf_hazard_release(writer);
+    lf_pool_dealloc(&node_pool, atomic_load(&shared));
+    lf_hazard_destroy(&domain);
+
+    size_t free_blocks = 0;
+    for (LFPoolBlock* batch; (batch = (LFPoolBlock*)lf_stack_pop(&node_pool.free_list)) != NULL;)
+        for (LFPoolBlock* block = batch; block != NULL; block = block->batch)
+            ++free_blocks;
+    gp_assert(free_blocks == 64 * atomic_load(&backing.allocations), free_blocks);
+    lf_pool_destroy(&node_pool);
+    gp_assert(atomic_load(&backing.allocations) == 0);
+}
+
+CountingAllocator epoch_allocator = COUNTING_ALLOCATOR;
+LFEpochDomain epoch_domain;
+LFAtomic(void*) epoch_shared;
+LFAtomic(bool) epoch_done;
+
+void* epoch_read(void*_)
+{
+    (void)_;
+    LFEpochRecord* record = lf_epoch_acquire(&epoch_domain);
+    size_t last_value = 0;
+    while ( ! atomic_load(&epoch_done)) {
+        lf_epoch_enter(&epoch_domain, record);
+        for (size_t i = 0; i < 16; ++i) {
+            HazardObject* object = (HazardObject*)atomic_load(&epoch_shared);
+            gp_assert(object->magic == HAZARD_ALIVE, "Object got deallocated in critical section.");
+            gp_assert(object->value >= last_value);
+            last_value = object->value;
+        }
+        lf_epoch_exit(record);
+    }
+    lf_epoch_release(record);
+    return NULL;
+}
+
+HazardObject* epoch_new(const GPAllocator* allocator, size_t value)
+{
+    HazardObject* object = (HazardObject*)gp_mem_alloc(allocator, sizeof*object);
+    object->magic = HAZARD_ALIVE;
+    object->value = value;
+    return object;
+}
+
+void test_epoch(void)
+{
+    lf_epoch_init(&epoch_domain, &epoch_allocator.allocator);
+    atomic_store(&epoch_shared, (void*)epoch_new(&epoch_allocator.allocator, 0));
+
+    pthread_t readers[HAZARD_READERS];
+    for (size_t i = 0; i < HAZARD_READERS; ++i)
+        pthread_create(&readers[i], NULL, epoch_read, NULL);
+
+    LFEpochRecord* record = lf_epoch_acquire(&epoch_domain);
+    gp_assert((uintptr_t)record % 64 == 0, "Records must be cache line aligned.");
+    // The epoch only advances when readers get to run, which can take longer
+    // than HAZARD_LENGTH retires if there are fewer CPUs than threads.
+    size_t value = 1;
+    for (; value <= HAZARD_LENGTH || atomic_load(&epoch_domain.epoch) <= 2; ++value)
+        lf_epoch_retire(&epoch_domain, record,
+            atomic_exchange(&epoch_shared, (void*)epoch_new(&epoch_allocator.allocator, value)));
+    size_t retired = record->limbo[0].length + record->limbo[1].length + record->limbo[2].length;
+    gp_assert(retired < value - 1, "Retired nodes should get reclaimed while running.");
+    lf_epoch_release(record);
+
+    atomic_store(&epoch_done, true);
+    for (size_t i = 0; i < HAZARD_READERS; ++i)
+        pthread_join(readers[i], NULL);
+
+    gp_mem_dealloc(&epoch_allocator.allocator, atomic_load(&epoch_shared));
+    lf_epoch_destroy(&epoch_domain);
+    gp_assert(atomic_load(&epoch_allocator.allocations) == 0, atomic_load(&epoch_allocator.allocations));
+}
+
+// Like test_hazard_pool(), records and limbo lists must not come from the pool.
+void test_epoch_pool(void)
+{
+    CountingAllocator backing = COUNTING_ALLOCATOR;
+    LFPool node_pool;
+    lf_pool_init(&node_pool, &backing.allocator, sizeof(HazardObject), 64);
+    LFEpochDomain domain;
+    lf_epoch_init(&domain, (const GPAllocator*)&node_pool);
+
+    LFEpochRecord* record = lf_epoch_acquire(&domain);
+    for (size_t i = 1; i <= 1000; ++i) {
+        lf_epoch_enter(&domain, record);
+        lf_epoch_retire(&domain, record, epoch_new((const GPAllocator*)&node_pool, i));
+        lf_epoch_exit(record);
+    }
+    size_t retired = record->limbo[0].length + record->limbo[1].length + record->limbo[2].length;
+    gp_assert(retired < 1000, "Retired nodes should get reclaimed to the pool.");
+    lf_epoch_release(record);
+    lf_epoch_destroy(&domain);
+
+    size_t free_blocks = 0;
+    for (LFPoolBlock* batch; (batch = (LFPoolBlock*)lf_stack_pop(&node_pool.free_list)) != NULL;)
+        for (LFPoolBlock* block = batch; block != NULL; block = block->batch)
+            ++free_blocks;
+    gp_assert(free_blocks == 64 * atomic_load(&backing.allocations), free_blocks);
+    lf_pool_destroy(&node_pool);
+    gp_assert(atomic_load(&backing.allocations) == 0);
+}
+
+#define POOL_THREADS 4
+#define POOL_ROUNDS  (1 << 10)
+#define POOL_BLOCKS  100
+#define POOL_CHUNK   256
+
+typedef struct pool_object
+{
+    size_t owner;
+    size_t index;
+    char payload[40];
+} PoolObject;
+
+CountingAllocator pool_backing = COUNTING_ALLOCATOR;
+LFPool pool;
+LFAtomic(void*) pool_exchange[POOL_THREADS];
+
+// Allocate from own cache, check that nobody else writes to the blocks, and
+// swap half of the blocks with other threads before deallocating.
+void* pool_thread(void* _owner)
+{
+    size_t owner = (size_t)_owner;
+    LFPoolCache cache;
+    lf_pool_cache_init(&cache, &pool);
+    PoolObject* objects[POOL_BLOCKS];
+
+    for (size_t round = 0; round < POOL_ROUNDS; ++round)
+    {
+        for (size_t i = 0; i < POOL_BLOCKS; ++i) {
+            objects[i] = (PoolObject*)gp_mem_alloc((const GPAllocator*)&cache, sizeof(PoolObject));
+            gp_assert((uintptr_t)objects[i] % GP_ALLOC_ALIGNMENT == 0);
+            objects[i]->owner = owner;
+            objects[i]->index = i;
+        }
+        for (size_t i = 0; i < POOL_BLOCKS; ++i)
+            gp_assert(objects[i]->owner == owner && objects[i]->index == i, "Block allocated twice.");
+
+        for (size_t i = 0; i < POOL_BLOCKS; ++i) {
+            void* block = objects[i];
+            if (i % 2)
+                block = atomic_exchange(&pool_exchange[(owner + i) % POOL_THREADS], block);
+            gp_mem_dealloc((const GPAllocator*)&cache, block);
+        }
+    }
+    lf_pool_cache_flush(&cache);
+    return NULL;
+}
+
+void test_pool(void)
+{
+    lf_pool_init(&pool, &pool_backing.allocator, sizeof(PoolObject), POOL_CHUNK);
+    gp_assert(pool.block_size >= sizeof(PoolObject) && pool.block_size % GP_ALLOC_ALIGNMENT == 0);
+
+    void* a = gp_mem_alloc((const GPAllocator*)&pool, sizeof(PoolObject));
+    void* b = lf_pool_alloc(&pool);
+    gp_assert(a != b);
+    gp_mem_dealloc((const GPAllocator*)&pool, a);
+    gp_assert(lf_pool_alloc(&pool) == a);
+    lf_pool_dealloc(&pool, a);
+    lf_pool_dealloc(&pool, b);
+
+    LFPoolCache cache;
+    lf_pool_cache_init(&cache, &pool);
+    void* c = lf_pool_cache_alloc(&cache);
+    lf_pool_cache_dealloc(&cache, c);
+    gp_assert(lf_pool_cache_alloc(&cache) == c, "Cache should return the most recently deallocated block.");
+    lf_pool_cache_dealloc(&cache, c);
+    lf_pool_cache_flush(&cache);
+
+    pthread_t threads[POOL_THREADS];
+    for (size_t i = 0; i < POOL_THREADS; ++i)
+        pthread_create(&threads[i], NULL, pool_thread, (void*)i);
+    for (size_t i = 0; i < POOL_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < POOL_THREADS; ++i)
+        if (atomic_load(&pool_exchange[i]) != NULL)
+            lf_pool_dealloc(&pool, atomic_load(&pool_exchange[i]));
+
+    // Every block of every chunk should be back in the free list exactly once.
+    size_t free_blocks = 0;
+    for (LFPoolBlock* batch; (batch = (LFPoolBlock*)lf_stack_pop(&pool.free_list)) != NULL;)
+        for (LFPoolBlock* block = batch; block != NULL; block = block->batch)
+            ++free_blocks;
+    gp_assert(free_blocks == POOL_CHUNK * atomic_load(&pool_backing.allocations), free_blocks);
+
+    lf_pool_destroy(&pool);
+    gp_assert(atomic_load(&pool_backing.allocations) == 0, atomic_load(&pool_backing.allocations));
+}
+
+#define SCHEDULER_WORKERS 3
+#define SCHEDULER_TASKS   10000
+
+LFScheduler scheduler;
+LFAtomic(size_t) scheduler_tasks_run;
+
+void scheduler_task(void*_)
+{
+    (void)_;
+    void* scratch = gp_alloc(gp_scratch_arena(), 64);
+    memset(scratch, 0, 64);
+    atomic_fetch_add(&scheduler_tasks_run, 1);
+}
+
+typedef struct fibonacci
+{
+    unsigned n;
+    uint64_t result;
+} Fibonacci;
+
+void fibonacci(void* _fib)
+{
+    Fibonacci* fib = (Fibonacci*)_fib;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+    Fibonacci a = { fib->n - 1, 0 };
+    Fibonacci b = { fib->n - 2, 0 };
+    LFTaskGroup group;
+    lf_task_group_init(&group, &scheduler);
+    lf_task_group_fork(&group, fibonacci, &a);
+    fibonacci(&b);
+    lf_task_group_join(&group);
+    fib->result = a.result + b.result;
+}
+
+void parallel_square(void* _arr, size_t begin, size_t end)
+{
+    uint64_t* arr = (uint64_t*)_arr;
+    for (size_t i = begin; i < end; ++i)
+        arr[i] = (uint64_t)i * i;
+}
+
+void test_scheduler(void)
+{
+    gp_assert(lf_scheduler_init(&scheduler, gp_heap, SCHEDULER_WORKERS, 64));
+
+    for (size_t i = 0; i < SCHEDULER_TASKS; ++i)
+        lf_scheduler_submit(&scheduler, scheduler_task, NULL);
+
+    Fibonacci fib = { 20, 0 };
+    fibonacci(&fib);
+    gp_assert(fib.result == 6765, fib.result);
+
+    const size_t length = 100000;
+    uint64_t* squares = (uint64_t*)gp_mem_alloc(gp_heap, length * sizeof squares[0]);
+    lf_parallel_for(&scheduler, length, 1000 - 1, parallel_square, squares);
+    for (size_t i = 0; i < length; ++i)
+        gp_assert(squares[i] == (uint64_t)i * i, i);
+    gp_mem_dealloc(gp_heap, squares);
+
+    lf_scheduler_destroy(&scheduler);
+    gp_assert(atomic_load(&scheduler_tasks_run) == SCHEDULER_TASKS);
+
+    #if LF_LINUX
+    // Limit address space to make creating thread stacks fail after a few.
+    size_t pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    gp_assert(statm != NULL && fscanf(statm, "%zu", &pages) == 1);
+    fclose(statm);
+    struct rlimit old_limit;
+    gp_assert(getrlimit(RLIMIT_AS, &old_limit) == 0);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = pages * (size_t)sysconf(_SC_PAGESIZE) + 32 * 1024 * 1024;
+    gp_assert(setrlimit(RLIMIT_AS, &limit) == 0);
+    bool started = lf_scheduler_init(&scheduler, gp_heap, 256, 64);
+    gp_assert(setrlimit(RLIMIT_AS, &old_limit) == 0);
+    gp_assert( ! started, "Creating 256 thread stacks should not fit in 32 MB.");
+
+    gp_assert(lf_scheduler_init(&scheduler, gp_heap, SCHEDULER_WORKERS, 64));
+    lf_scheduler_destroy(&scheduler);
+    #endif
+}
+
+#if LF_POSIX
+// Runs in a child process attaching to the queue by name.
+int shared_consume(const char* name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    LFSharedQueue* queue = fd == -1 ? NULL : lf_shared_queue_attach(fd);
+    if (queue == NULL)
+        return EXIT_FAILURE;
+    for (size_t i = 1; i <= DATA_LENGTH; ++i) {
+        size_t out;
+        while ( ! lf_shared_dequeue(queue, &out));
+        if (out != i)
+            return EXIT_FAILURE;
+    }
+    lf_shared_queue_unmap(queue);
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+void test_shared_queue(void)
+{
+    FILE* garbage = tmpfile();
+    gp_assert(garbage != NULL);
+    gp_assert(ftruncate(fileno(garbage), 4096) == 0);
+    gp_assert(lf_shared_queue_attach(fileno(garbage)) == NULL && errno == EINVAL);
+    gp_assert(lf_shared_queue_create(fileno(garbage), sizeof(size_t), 3) == NULL && errno == EINVAL);
+
+    // Recreating discards old content.
+    LFSharedQueue* old_queue = lf_shared_queue_create(fileno(garbage), 1, 4096);
+    gp_assert(old_queue != NULL);
+    memset((void*)(old_queue + 1), 0xFF, 4096);
+    lf_shared_queue_unmap(old_queue);
+    LFSharedQueue* recreated = lf_shared_queue_create(fileno(garbage), 1, 4096);
+    gp_assert(recreated != NULL);
+    for (size_t i = 0; i < 4096; ++i)
+        gp_assert(((unsigned char*)(recreated + 1))[i] == 0, i);
+    lf_shared_queue_unmap(recreated);
+    fclose(garbage);
+
+    char name[64];
+    snprintf(name, sizeof name, "/lfc_tests_%li", (long)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    gp_assert(fd != -1);
+    LFSharedQueue* queue = lf_shared_queue_create(fd, sizeof(size_t), QUEUE_BUF_SIZE);
+    gp_assert(queue != NULL);
+
+    pid_t consumer = fork();
+    gp_assert(consumer != -1);
+    if (consumer == 0)
+        _exit(shared_consume(name));
+
+    for (size_t i = 1; i <= DATA_LENGTH; ++i)
+        while ( ! lf_shared_enqueue(queue, &i));
+    int status;
+    gp_assert(waitpid(consumer, &status, 0) == consumer);
+    gp_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "Consumer process failed.");
+    size_t out;
+    gp_assert(lf_shared_dequeue(queue, &out) == NULL);
+
+    lf_shared_queue_unmap(queue);
+    close(fd);
+    shm_unlink(name);
+}
+#endif
+
+#if LF_LINUX
+void test_huge_pages(void)
+{
+    const size_t size = 3 * LF_HUGE_PAGE_SIZE / 2;
+    unsigned char* memory = (unsigned char*)lf_huge_alloc(size);
+    gp_assert(memory != NULL);
+    gp_assert((uintptr_t)memory % LF_HUGE_PAGE_SIZE == 0);
+    gp_assert(memory[0] == 0 && memory[size - 1] == 0);
+    gp_assert(lf_huge_size(size) == 2 * LF_HUGE_PAGE_SIZE);
+    memset(memory, 0xff, lf_huge_size(size)); // whole mapping is usable
+
+    #if __cplusplus
+    LFSPSCQueue q = {};
+    #else
+    LFSPSCQueue q = {0};
+    #endif
+    q.buffer = memory;
+    q.buffer_length = LF_HUGE_PAGE_SIZE / sizeof(size_t);
+    for (size_t i = 0; i < 64; ++i)
+        gp_assert(lf_spsc_enqueue(&q, &i, sizeof i));
+    for (size_t i = 0; i < 64; ++i) {
+        size_t out;
+        gp_assert(lf_spsc_dequeue(&q, &out, sizeof out) && out == i);
+    }
+    lf_huge_free(memory, size);
+
+    size_t* block = (size_t*)gp_mem_alloc(lf_huge_allocator(), 1000 * sizeof block[0]);
+    gp_assert((uintptr_t)block % GP_ALLOC_ALIGNMENT == 0);
+    for (size_t i = 0; i < 1000; ++i)
+        block[i] = i;
+    gp_assert(block[999] == 999);
+    gp_mem_dealloc(lf_huge_allocator(), block);
+
+    GPArena huge_arena = gp_arena_new(4 * LF_HUGE_PAGE_SIZE);
+    lf_huge_advise(gp_alloc(&huge_arena, 0), 4 * LF_HUGE_PAGE_SIZE); // best effort
+    gp_arena_delete(&huge_arena);
+}
+
+void test_numa(void)
+{
+    int node = lf_numa_node();
+    LFSPSCQueue* q = lf_spsc_new_numa(sizeof(size_t), QUEUE_BUF_SIZE, node);
+    gp_assert(q != NULL);
+    gp_assert(q->buffer == (void*)(q + 1), "Buffer should follow the queue in the same mapping.");
+    gp_assert(q->buffer_length == QUEUE_BUF_SIZE);
+    gp_assert(q->numa_policy != LF_NUMA_DEFAULT);
+    gp_assert(q->numa_node == node);
+    for (size_t i = 0; i < QUEUE_BUF_SIZE - 1; ++i)
+        gp_assert(lf_spsc_enqueue(q, &i, sizeof i));
+    for (size_t i = 0; i < QUEUE_BUF_SIZE - 1; ++i) {
+        size_t out;
+        gp_assert(lf_spsc_dequeue(q, &out, sizeof out) && out == i);
+    }
+    lf_spsc_delete_numa(q, sizeof(size_t));
+
+    gp_assert(lf_spsc_new_numa(sizeof(size_t), 0, node) == NULL && errno == EINVAL);
+    gp_assert(lf_spsc_new_numa(sizeof(size_t), 100, node) == NULL && errno == EINVAL);
+    gp_assert(lf_spsc_new_numa(SIZE_MAX / 4, 8, node) == NULL && errno == ENOMEM);
+}
+#endif
+
+#if __cplusplus
+lf::spsc_queue<size_t, QUEUE_BUF_SIZE> cpp_queue;
+
+void* cpp_produce(void*)
+{
+    for (size_t i = 1; i <= DATA_LENGTH; ++i)
+        while ( ! cpp_queue.enqueue(i));
+    return NULL;
+}
+
+void test_cpp_queue(void)
+{
+    lf::spsc_queue<Order, 4> orders;
+    for (size_t i = 0; i < 4; ++i) {
+        Order order = {};
+        order.id = i;
+        gp_assert(orders.enqueue(order));
+    }
+    gp_assert( ! orders.enqueue(Order()), "Queue should hold exactly 4 elements.");
+    for (size_t i = 0; i < 4; ++i) {
+        Order order;
+        gp_assert(orders.dequeue(order) && order.id == i);
+    }
+    Order order;
+    gp_assert( ! orders.dequeue(order));
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, cpp_produce, NULL);
+    for (size_t i = 1; i <= DATA_LENGTH; ++i) {
+        size_t out;
+        while ( ! cpp_queue.dequeue(out));
+        gp_assert(out == i, out, i);
+    }
+    pthread_join(producer, NULL);
+}
+#endif
+
 int main(void)
 {
     arena = gp_arena_new(1024 * 1024 * 1024);
-    size_t* arr = gp_alloc(&arena, DATA_LENGTH * sizeof arr[0]);
+    size_t* arr = (size_t*)gp_alloc(&arena, DATA_LENGTH * sizeof arr[0]);
     #if ! MACRO_TEST || __cplusplus
     queue.buffer = gp_alloc(&arena, QUEUE_BUF_SIZE * sizeof(size_t));
     queue.buffer_length = QUEUE_BUF_SIZE;
     #endif
-    signal(SIGINT, be_done);
+    test_batch();
+    test_in_place();
+    test_ring();
+    test_mpsc();
+    test_spmc();
+    test_mpmc();
+    test_segmented();
+    test_waiting();
+    test_histogram();
+    test_typed_queue();
+    test_broadcast();
+    test_pipeline();
+    test_deque();
+    test_scheduler();
+    test_stack();
+    test_hazard();
+    test_hazard_pool();
+    test_epoch();
+    test_epoch_pool();
+    test_pool();
+    #ifdef LF_STATS
+    test_stats();
+    #endif
+    #if LF_POSIX
+    test_shared_queue();
+    #endif
+    #if LF_LINUX
+    test_huge_pages();
+    test_numa();
+    #endif
+    #if __cplusplus
+    test_cpp_queue();
+    #endif
 
-    start:
-    gp_println("Starting work.");
-    volatile uint64_t t0 = __rdtsc();
     pthread_t reader, writer;
     pthread_create(&writer, NULL, produce, NULL);
     pthread_create(&reader, NULL, consume, arr);
     pthread_join(writer, NULL);
     pthread_join(reader, NULL);
-    volatile uint64_t t1 = __rdtsc();
 
     for (size_t i = 0; i < DATA_LENGTH - 1; ++i)
         gp_assert(arr[i] == arr[i + 1] - 1 && arr[i] != 0, arr[i], arr[i + 1], i);
-    memset(arr, 0, DATA_LENGTH * sizeof arr[0]);
-    gp_println("Success. Time: %f", filter((double)(t1 - t0) / 1000000.));
-    gp_print("\r" GP_CURSOR_UP(2));
-    if ( ! done)
-        goto start;
-    gp_println("");
+    gp_println("Success.");
     gp_arena_delete(&arena);
     return 0;
 }